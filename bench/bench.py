@@ -0,0 +1,277 @@
+"""Benchmark rapidjson against the standard json module.
+
+Measures loads/dumps/load/dump throughput (MB/s), latency percentiles and
+peak memory on the nativejson-benchmark corpora (fetched by
+bench/fetch_data.py into bench/data/) and on generated data sets, and
+writes a JSON report that can be diffed between commits:
+
+    $ python bench/bench.py --output before.json
+    $ python bench/bench.py --output after.json --compare before.json
+"""
+import argparse
+import gc
+import hashlib
+import io
+import json
+import os
+import platform
+import random
+import subprocess
+import sys
+import time
+
+try:
+    import resource
+except ImportError:
+    resource = None
+try:
+    import tracemalloc
+except ImportError:
+    tracemalloc = None
+
+import rapidjson
+
+from corpora import STANDARD_CORPORA, bench_root, data_root
+
+
+def generate_deep_nesting(depth=200):
+    obj = {"leaf": [1, 2.5, "three", None, True]}
+    for i in range(depth):
+        obj = {"level": i, "child": [obj]}
+    return json.dumps(obj)
+
+
+def generate_wide_object(width=20000):
+    rnd = random.Random(14)
+    return json.dumps(dict(("key_%06d" % i, rnd.choice([i, i * 0.5, "v%d" % i, None, False]))
+                           for i in range(width)))
+
+
+def generate_long_string(length=1 << 20):
+    rnd = random.Random(14)
+    alphabet = u"abcdefghijklmnopqrstuvwxyz \\\"\néあ\U0001f600"
+    return json.dumps([u"".join(rnd.choice(alphabet) for _ in range(length))],
+                      ensure_ascii=False)
+
+
+def generate_ndjson(lines=20000):
+    rnd = random.Random(14)
+    out = []
+    for i in range(lines):
+        out.append(json.dumps({"id": i, "user": "user%d" % rnd.randint(0, 999),
+                               "score": rnd.random(), "tags": ["a", "b", "c"][:i % 4],
+                               "ok": i % 3 == 0}))
+    return "\n".join(out) + "\n"
+
+
+def generate_records(rows=50000):
+    rnd = random.Random(14)
+    return json.dumps([{"id": i, "name": "user%d" % rnd.randint(0, 999),
+                        "ts": 1500000000 + i, "score": rnd.random(), "active": i % 2 == 0}
+                       for i in range(rows)])
+
+
+GENERATED_CORPORA = [
+    ('deep_nesting', generate_deep_nesting),
+    ('wide_object', generate_wide_object),
+    ('records', generate_records),
+    ('long_string', generate_long_string),
+    ('ndjson', generate_ndjson),
+]
+
+
+def load_corpora(names):
+    corpora = []
+    for name in STANDARD_CORPORA:
+        path = os.path.join(data_root, name)
+        if names and name not in names:
+            continue
+        if not os.path.exists(path):
+            sys.stderr.write("skipping %s: run 'make bench-data' to fetch it\n" % name)
+            continue
+        with io.open(path, encoding='utf-8') as f:
+            corpora.append((name, f.read()))
+    for name, generate in GENERATED_CORPORA:
+        if names and name not in names:
+            continue
+        corpora.append((name, generate()))
+    return corpora
+
+
+def ndjson_loads(module, text):
+    return [module.loads(line) for line in text.splitlines()]
+
+
+def ndjson_dumps(module, objs):
+    return "\n".join(module.dumps(obj) for obj in objs) + "\n"
+
+
+def ndjson_loads_many(module, text):
+    if module is rapidjson:
+        return rapidjson.loads_many(text.splitlines())
+    return ndjson_loads(module, text)
+
+
+def ndjson_load(module, text):
+    if module is rapidjson:
+        return list(rapidjson.iterload(io.StringIO(text)))
+    return [json.loads(line) for line in io.StringIO(text)]
+
+
+def operations(module, name, text):
+    """(operation, callable) pairs for one module and corpus"""
+    if name == 'ndjson':
+        objs = ndjson_loads(json, text)
+        return [
+            ('loads', lambda: ndjson_loads(module, text)),
+            ('loads_many', lambda: ndjson_loads_many(module, text)),
+            ('dumps', lambda: ndjson_dumps(module, objs)),
+            ('load', lambda: ndjson_load(module, text)),
+            ('dump', lambda: [module.dump(obj, io.StringIO()) for obj in objs]),
+        ]
+    obj = json.loads(text)
+    return [
+        ('loads', lambda: module.loads(text)),
+        ('dumps', lambda: module.dumps(obj)),
+        ('load', lambda: module.load(io.StringIO(text))),
+        ('dump', lambda: module.dump(obj, io.StringIO())),
+    ]
+
+
+def percentile(sorted_values, fraction):
+    index = min(len(sorted_values) - 1, int(round(fraction * (len(sorted_values) - 1))))
+    return sorted_values[index]
+
+
+def max_rss_kb():
+    if resource is None:
+        return None
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    if sys.platform == 'darwin':
+        rss //= 1024
+    return rss
+
+
+def measure(func, size, repeat, min_time):
+    func()  # warm up caches and the key cache
+
+    samples = []
+    started = time.time()
+    while len(samples) < repeat or time.time() - started < min_time:
+        gc.collect()
+        t0 = time.perf_counter() if hasattr(time, 'perf_counter') else time.time()
+        func()
+        t1 = time.perf_counter() if hasattr(time, 'perf_counter') else time.time()
+        samples.append(t1 - t0)
+        if len(samples) >= repeat * 10:
+            break
+    samples.sort()
+
+    # tracemalloc sees Python allocations only; the RSS high-water mark
+    # also covers rapidjson's own buffers, but only ever grows.
+    peak_traced = None
+    if tracemalloc is not None:
+        gc.collect()
+        tracemalloc.start()
+        func()
+        peak_traced = tracemalloc.get_traced_memory()[1]
+        tracemalloc.stop()
+    rss_before = max_rss_kb()
+    func()
+    rss_after = max_rss_kb()
+
+    median = percentile(samples, 0.5)
+    return {
+        'runs': len(samples),
+        'mb_per_sec': round(size / median / 1e6, 2) if median else None,
+        'latency_ms': {
+            'min': round(samples[0] * 1e3, 4),
+            'p50': round(median * 1e3, 4),
+            'p90': round(percentile(samples, 0.9) * 1e3, 4),
+            'p99': round(percentile(samples, 0.99) * 1e3, 4),
+        },
+        'peak_traced_bytes': peak_traced,
+        'max_rss_growth_kb': (rss_after - rss_before) if rss_before is not None else None,
+    }
+
+
+def git_revision():
+    try:
+        out = subprocess.check_output(['git', 'rev-parse', 'HEAD'], cwd=bench_root,
+                                      stderr=subprocess.STDOUT)
+        return out.decode('ascii').strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def run(args):
+    modules = [('rapidjson', rapidjson), ('json', json)]
+    report = {
+        'revision': git_revision(),
+        'python': platform.python_version(),
+        'platform': platform.platform(),
+        'rapidjson_module': getattr(rapidjson, '__file__', None),
+        'corpora': {},
+    }
+    for name, text in load_corpora(args.corpus):
+        data = text.encode('utf-8')
+        size = len(data)
+        sys.stderr.write("%s (%d bytes)\n" % (name, size))
+        result = {'bytes': size, 'sha256': hashlib.sha256(data).hexdigest(),
+                  'results': {}}
+        for module_name, module in modules:
+            result['results'][module_name] = {}
+            for op, func in operations(module, name, text):
+                stats = measure(func, size, args.repeat, args.min_time)
+                result['results'][module_name][op] = stats
+                sys.stderr.write("  %-9s %-10s %9.2f MB/s  p50 %9.3f ms  p99 %9.3f ms\n" % (
+                    module_name, op, stats['mb_per_sec'] or 0,
+                    stats['latency_ms']['p50'], stats['latency_ms']['p99']))
+        report['corpora'][name] = result
+    return report
+
+
+def compare(old, new):
+    """print rapidjson throughput of `new` relative to `old`"""
+    for name in sorted(new['corpora']):
+        if name not in old['corpora']:
+            continue
+        before = old['corpora'][name]['results'].get('rapidjson', {})
+        after = new['corpora'][name]['results'].get('rapidjson', {})
+        for op in ('loads', 'loads_many', 'dumps', 'load', 'dump'):
+            if op not in before or op not in after:
+                continue
+            b, a = before[op]['mb_per_sec'], after[op]['mb_per_sec']
+            if b and a:
+                print("%-14s %-10s %9.2f -> %9.2f MB/s (%+.1f%%)" % (
+                    name, op, b, a, (a / b - 1) * 100))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--output', '-o', help='write the JSON report here')
+    parser.add_argument('--compare', metavar='REPORT',
+                        help='print the change against an earlier report')
+    parser.add_argument('--corpus', action='append',
+                        help='only run this corpus (may be repeated)')
+    parser.add_argument('--repeat', type=int, default=20,
+                        help='minimum number of timed runs per operation')
+    parser.add_argument('--min-time', type=float, default=0.5,
+                        help='minimum seconds spent per operation')
+    args = parser.parse_args()
+
+    report = run(args)
+    if args.output:
+        with open(args.output, 'w') as f:
+            json.dump(report, f, indent=2, sort_keys=True)
+            f.write('\n')
+    else:
+        json.dump(report, sys.stdout, indent=2, sort_keys=True)
+        sys.stdout.write('\n')
+    if args.compare:
+        with open(args.compare) as f:
+            compare(json.load(f), report)
+
+
+if __name__ == '__main__':
+    main()
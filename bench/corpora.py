@@ -0,0 +1,8 @@
+"""Benchmark corpora shared by bench.py and fetch_data.py (no rapidjson import)."""
+import os
+
+
+bench_root = os.path.dirname(os.path.abspath(__file__))
+data_root = os.path.join(bench_root, 'data')
+
+STANDARD_CORPORA = ['twitter.json', 'canada.json', 'citm_catalog.json']
@@ -0,0 +1,30 @@
+"""Download the nativejson-benchmark corpora into bench/data/."""
+import os
+import sys
+
+try:
+    from urllib.request import urlopen
+except ImportError:
+    from urllib2 import urlopen
+
+from corpora import STANDARD_CORPORA, data_root
+
+BASE_URL = 'https://raw.githubusercontent.com/miloyip/nativejson-benchmark/master/data/'
+
+
+def main():
+    if not os.path.isdir(data_root):
+        os.makedirs(data_root)
+    for name in STANDARD_CORPORA:
+        path = os.path.join(data_root, name)
+        if os.path.exists(path):
+            continue
+        sys.stderr.write("fetching %s\n" % name)
+        data = urlopen(BASE_URL + name).read()
+        with open(path + '.tmp', 'wb') as f:
+            f.write(data)
+        os.rename(path + '.tmp', path)
+
+
+if __name__ == '__main__':
+    main()
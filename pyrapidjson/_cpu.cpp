@@ -0,0 +1,99 @@
+/*
+ * CPU feature detection for rapidjson.py, which imports the best variant
+ * of the extension (see setup.py). Kept apart from _pyrapidjson.cpp so it
+ * is never built with instruction sets the CPU might lack.
+ */
+#include <Python.h>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define CPU_X86_MSVC
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_X86_GNUC
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+#define PY3
+#endif
+
+PyDoc_STRVAR(cpu__doc__, "CPU feature detection for picking the rapidjson variant");
+PyDoc_STRVAR(cpu_features__doc__,
+             "Return which of the instruction sets the variants need are usable");
+
+static bool
+cpu_has_sse42(void)
+{
+#if defined(CPU_X86_GNUC)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+#elif defined(CPU_X86_MSVC)
+    int regs[4];
+    __cpuid(regs, 1);
+    return (regs[2] & (1 << 20)) != 0;
+#else
+    return false;
+#endif
+}
+
+static bool
+cpu_has_avx2(void)
+{
+#if defined(CPU_X86_GNUC)
+    /* also checks that the OS saves the AVX registers */
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#elif defined(CPU_X86_MSVC)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7) {
+        return false;
+    }
+    __cpuid(regs, 1);
+    /* OSXSAVE and AVX, then the OS must save the XMM and YMM state */
+    if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0 ||
+        (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+static PyObject *
+cpu_features(PyObject *self, PyObject *args)
+{
+    return Py_BuildValue("{s:O,s:O}",
+                         "sse42", cpu_has_sse42() ? Py_True : Py_False,
+                         "avx2", cpu_has_avx2() ? Py_True : Py_False);
+}
+
+static PyMethodDef CpuMethods[] = {
+    {"cpu_features", (PyCFunction)cpu_features, METH_NOARGS,
+     cpu_features__doc__},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+#ifdef PY3
+static struct PyModuleDef cpu_module_def = {
+    PyModuleDef_HEAD_INIT,
+    "_rapidjson_cpu",
+    cpu__doc__,
+    -1,
+    CpuMethods,
+};
+
+PyMODINIT_FUNC
+PyInit__rapidjson_cpu(void)
+{
+    return PyModule_Create(&cpu_module_def);
+}
+#else
+PyMODINIT_FUNC
+init_rapidjson_cpu(void)
+{
+    Py_InitModule3("_rapidjson_cpu", CpuMethods, cpu__doc__);
+}
+#endif
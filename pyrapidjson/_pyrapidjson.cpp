@@ -1,17 +1,47 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <datetime.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <algorithm>
 #include <cstdio>
 #include <sstream>
+#include <string>
+#include <vector>
 
 #include "rapidjson/rapidjson.h"
 #include "rapidjson/error/en.h"
+#include "rapidjson/reader.h"
 #include "rapidjson/document.h"
+#include "rapidjson/pointer.h"
+#include "rapidjson/schema.h"
 #include "rapidjson/prettywriter.h"
 #include "rapidjson/stringbuffer.h"
+#include "rapidjson/memorystream.h"
 #include "rapidjson/filereadstream.h"
 #include "rapidjson/filewritestream.h"
 #include "rapidjson/encodedstream.h"
 
+#ifdef _WIN32
+#include <io.h>
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+
 #if PY_MAJOR_VERSION >= 3
 #define PY3
 #define PyInt_FromLong PyLong_FromLong
@@ -20,6 +50,7 @@
 #define PyString_FromStringAndSize PyUnicode_FromStringAndSize
 #define PyString_Check PyBytes_Check
 #define PyString_AsString PyBytes_AsString
+#define PyString_Size PyBytes_Size
 #define PyString_GET_SIZE PyUnicode_GET_SIZE
 #endif
 
@@ -33,642 +64,5243 @@
 #define _PyVerify_fd(FD) (1)
 #endif
 
-static bool pyobj2doc(PyObject *object, rapidjson::Document& doc);
-static bool pyobj2doc(PyObject *object, rapidjson::Value& doc, rapidjson::Document& root);
+/*
+ * Free-threaded builds (Py_GIL_DISABLED, 3.13+) run calls on one object
+ * from several threads at once. Py_BEGIN_CRITICAL_SECTION locks the object
+ * there and is a plain block in every other build.
+ */
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+#if PY_VERSION_HEX >= 0x03090000
+#define current_interpreter() PyInterpreterState_Get()
+#else
+#define current_interpreter() (PyThreadState_GET()->interp)
+#endif
+
+/* multi-phase init (PEP 489): one module object per interpreter */
+#if PY_VERSION_HEX >= 0x03050000
+#define PYRAPIDJSON_MULTI_PHASE_INIT
+#endif
+
+/*
+ * How pyobj2writer() encodes: sort_keys writes the members of an object
+ * ordered by key, canonical (fingerprint()) also writes floats holding an
+ * integer as integers, so that 1 and 1.0 encode alike. namedtuple_as_object
+ * writes namedtuples as objects of their fields rather than as arrays.
+ * default_ is called with objects of any other type than those known
+ * here, and what it returns is encoded in their place.
+ */
+struct EncodeOptions {
+    bool sort_keys;
+    bool canonical;
+    bool namedtuple_as_object;
+    PyObject *default_;             /* borrowed; NULL for none */
+
+    /*
+     * The classes of datetime, uuid, decimal, enum and dataclasses, looked
+     * up in sys.modules on the first object of none of the basic types: a
+     * module that was never imported has no instances to encode.
+     */
+    mutable bool types_loaded;
+    mutable PyObject *datetime_type, *date_type, *time_type, *timedelta_type;
+    mutable PyObject *uuid_type, *decimal_type, *enum_type, *dataclass_field;
+
+    EncodeOptions()
+        : sort_keys(false), canonical(false), namedtuple_as_object(false), default_(NULL),
+          types_loaded(false),
+          datetime_type(NULL), date_type(NULL), time_type(NULL), timedelta_type(NULL),
+          uuid_type(NULL), decimal_type(NULL), enum_type(NULL), dataclass_field(NULL) {}
+
+    ~EncodeOptions() {
+        Py_XDECREF(datetime_type);
+        Py_XDECREF(date_type);
+        Py_XDECREF(time_type);
+        Py_XDECREF(timedelta_type);
+        Py_XDECREF(uuid_type);
+        Py_XDECREF(decimal_type);
+        Py_XDECREF(enum_type);
+        Py_XDECREF(dataclass_field);
+    }
+
+private:
+    EncodeOptions(const EncodeOptions&);
+    EncodeOptions& operator=(const EncodeOptions&);
+};
+
+template <typename Writer>
+static bool pyobj2writer(PyObject *object, Writer& writer, const EncodeOptions& options);
+
 
-static PyObject* _doc2pyobj(rapidjson::Document&, char *);
-static PyObject* doc2pyobj(rapidjson::Document&);
-static PyObject* _get_pyobj_from_object(
-        rapidjson::Value::ConstMemberIterator& doc, PyObject *root,
-        const char *key);
+/*
+ * setup.py builds this file once per instruction set, through the wrappers
+ * in variants/ that define PYRAPIDJSON_VARIANT (baseline, sse42, avx2), as
+ * the modules _rapidjson_<variant>; rapidjson.py imports the best one the
+ * CPU supports. Built on its own it is the plain rapidjson module.
+ */
+#define PYRAPIDJSON_CAT(a, b) a##b
+#define PYRAPIDJSON_XCAT(a, b) PYRAPIDJSON_CAT(a, b)
+#define PYRAPIDJSON_STR(a) #a
+#define PYRAPIDJSON_XSTR(a) PYRAPIDJSON_STR(a)
+#ifdef PYRAPIDJSON_VARIANT
+#define PYRAPIDJSON_VARIANT_NAME PYRAPIDJSON_XSTR(PYRAPIDJSON_VARIANT)
+#define PYRAPIDJSON_MODULE_NAME "_rapidjson_" PYRAPIDJSON_VARIANT_NAME
+#define PYRAPIDJSON_MODULE_INIT(prefix) \
+    PYRAPIDJSON_XCAT(PYRAPIDJSON_CAT(prefix, _rapidjson_), PYRAPIDJSON_VARIANT)
+#else
+#define PYRAPIDJSON_VARIANT_NAME "default"
+#define PYRAPIDJSON_MODULE_NAME "rapidjson"
+#define PYRAPIDJSON_MODULE_INIT(prefix) PYRAPIDJSON_CAT(prefix, rapidjson)
+#endif
 
 /* The module doc strings */
 PyDoc_STRVAR(pyrapidjson__doc__, "Python binding for rapidjson");
-PyDoc_STRVAR(pyrapidjson_loads__doc__, "Decoding JSON");
-PyDoc_STRVAR(pyrapidjson_load__doc__, "Decoding JSON file like object");
-PyDoc_STRVAR(pyrapidjson_dumps__doc__, "Encoding JSON");
-PyDoc_STRVAR(pyrapidjson_dump__doc__, "Encoding JSON file like object");
+PyDoc_STRVAR(pyrapidjson_loads__doc__,
+             "Decoding JSON from str or any bytes-like object\n\n"
+             "fields: JSON Pointers (or a nested dict of keys) of the object\n"
+             "members to keep; everything else is skipped while parsing.\n"
+             "Arrays are passed through, e.g. \"/items/id\".\n"
+             "schema: a rapidjson.Schema the text is validated against while\n"
+             "it is parsed; ValidationError is raised if it does not match.");
+PyDoc_STRVAR(pyrapidjson_load__doc__,
+             "Decoding JSON file like object, read in chunk_size pieces");
+PyDoc_STRVAR(pyrapidjson_iterload__doc__,
+             "Iterate over the concatenated JSON values (e.g. NDJSON) of a file like object");
+PyDoc_STRVAR(pyrapidjson_load_path__doc__,
+             "Decoding JSON file at path, memory-mapped instead of read");
+PyDoc_STRVAR(pyrapidjson_loads_many__doc__,
+             "Decoding each of a sequence of JSON texts into a list\n\n"
+             "The texts are parsed in parallel by `threads` native threads (one\n"
+             "per CPU by default, fewer for small batches) with the GIL released,\n"
+             "then converted to Python objects in order. A text that fails gets\n"
+             "its exception object in its place instead of raising.");
+PyDoc_STRVAR(pyrapidjson_loads_columns__doc__,
+             "Decoding a JSON array of flat objects into columns\n\n"
+             "columns: {name: type}, type one of int64, int32, float64, float32,\n"
+             "bool and str. Numeric and bool columns come back as read-only\n"
+             "memoryviews of typed buffers, like the immutable str and bytes of the\n"
+             "other decoders (copy them, e.g. with numpy.array(), to modify);\n"
+             "str columns as lists (null is None); other members are skipped.");
+PyDoc_STRVAR(pyrapidjson_dumps__doc__,
+             "Encoding JSON; with ensure_ascii=False non-ASCII characters are output as they are,\n"
+             "with sort_keys=True the members of objects are ordered by key.\n"
+             "datetime, date and time are written in ISO 8601, UUID as a string, Decimal as\n"
+             "a number, Enum as its value, dataclasses as objects (and namedtuples too with\n"
+             "namedtuple_as_object=True; arrays otherwise); default(obj) is called for\n"
+             "anything else and should return an encodable object");
+PyDoc_STRVAR(pyrapidjson_dump__doc__,
+             "Encoding JSON file like object, written in chunk_size pieces");
+PyDoc_STRVAR(pyrapidjson_fingerprint__doc__,
+             "Hash of the canonical JSON encoding of obj (keys sorted, no whitespace,\n"
+             "UTF-8, integral floats as integers) as a hex string, computed without\n"
+             "building the encoded text. algo is any hashlib algorithm, or \"xxh3\"\n"
+             "with the xxhash package installed");
+PyDoc_STRVAR(pyrapidjson_dump_iter__doc__,
+             "Encoding the items of an iterable lazily, as a JSON array or (with\n"
+             "format=\"ndjson\") one line each; yields bytes chunks of at least\n"
+             "chunk_size bytes, except the last");
 
+/*
+ * loads() releases the GIL for texts of at least this many bytes (unless
+ * told otherwise with release_gil=); smaller ones are not worth the
+ * Document round trip.
+ */
+#define NOGIL_THRESHOLD (256 * 1024)
+/* loads_many() starts at most one thread per this many bytes of text */
+#define LOADS_MANY_THREAD_BYTES (64 * 1024)
+/* default size of the pieces load() asks the file object for */
+#define LOAD_CHUNK_SIZE 65536
+/* default size of the pieces dump() hands to the file object */
+#define DUMP_CHUNK_SIZE 65536
+/*
+ * Memory a Decoder or Encoder keeps between calls (unless told otherwise
+ * with max_retained=); anything a larger call needed is given back.
+ */
+#define RETAINED_CAPACITY (1024 * 1024)
+PyDoc_STRVAR(pyrapidjson_cache_info__doc__,
+             "Return hits, misses, size and maxsize of the decoded key cache");
+PyDoc_STRVAR(pyrapidjson_cache_clear__doc__, "Clear the decoded key cache");
+PyDoc_STRVAR(pyrapidjson_stats__doc__,
+             "Return the counters and per-phase timers (nanoseconds) collected\n"
+             "when built with PYRAPIDJSON_STATS; 'enabled' is False otherwise");
+PyDoc_STRVAR(pyrapidjson_reset_stats__doc__, "Reset the counters returned by stats()");
+PyDoc_STRVAR(pyrapidjson_build_info__doc__,
+             "Return the build variant, its SIMD code paths, the rapidjson version\n"
+             "and whether this is a free-threaded build");
 
-static inline bool
-pyobj2doc_pair(PyObject *key, PyObject *value,
-               rapidjson::Value& doc, rapidjson::Document& root)
-{
-    const char *key_string;
-#ifdef PY3
-    PyObject *utf8_item;
-    utf8_item = PyUnicode_AsUTF8String(key);
-    key_string = PyBytes_AsString(utf8_item);
+
+/*
+ * Opt-in instrumentation (build with -DPYRAPIDJSON_STATS, e.g.
+ * PYRAPIDJSON_STATS=1 python setup.py build). Without it the STATS_*
+ * macros expand to nothing. Counters are only updated with the GIL held;
+ * free-threaded builds take a lock for each update instead, so leave stats
+ * off when measuring how they scale.
+ *
+ *   decode_ns   SAX parse straight into Python objects (loads, load, ...)
+ *   parse_ns    parse into a rapidjson::Document (release_gil, Document)
+ *   convert_ns  Document to Python objects
+ *   encode_ns   Python objects through the Writer (dumps, dump, Encoder)
+ */
+#ifdef PYRAPIDJSON_STATS
+#define STATS_ENABLED 1
+
+struct Stats {
+    uint64_t decode_calls;
+    uint64_t encode_calls;
+    uint64_t decode_ns;
+    uint64_t parse_ns;
+    uint64_t convert_ns;
+    uint64_t encode_ns;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t allocator_bytes;
+    uint64_t max_depth;
+};
+
+static Stats stats;
+
+#if defined(_MSC_VER)
+#define STATS_THREAD_LOCAL __declspec(thread)
 #else
-    key_string = PyString_AsString(key);
+#define STATS_THREAD_LOCAL __thread
 #endif
-    rapidjson::Value s;
-    s.SetString(key_string, root.GetAllocator());
-    rapidjson::Value _v;
-    if (false == pyobj2doc(value, _v, root)) {
-        return false;
+/* nesting of the encoder on this thread */
+static STATS_THREAD_LOCAL size_t stats_encode_depth = 0;
+
+#ifdef Py_GIL_DISABLED
+static PyMutex stats_mutex;
+#define STATS_LOCK() PyMutex_Lock(&stats_mutex)
+#define STATS_UNLOCK() PyMutex_Unlock(&stats_mutex)
+#else
+#define STATS_LOCK()
+#define STATS_UNLOCK()
+#endif
+
+static inline uint64_t
+stats_now(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
     }
-    doc.AddMember(s, _v, root.GetAllocator());
-    return true;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart * 1000000000.0 / frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
 }
-static inline bool
-pyobj2doc_pair(PyObject *key, PyObject *value, rapidjson::Document& doc)
-{
-    const char *key_string;
-    PyObject *utf8_item = NULL;
-    PyObject *pyobj = NULL;
+
+#define STATS_START(timer) uint64_t timer = stats_now()
+#define STATS_STOP(field, timer) STATS_ADD(field, stats_now() - (timer))
+#define STATS_ADD(field, n) \
+    do { uint64_t n_ = (uint64_t)(n); STATS_LOCK(); stats.field += n_; STATS_UNLOCK(); } while (0)
+#define STATS_MAX(field, n) \
+    do { \
+        uint64_t n_ = (uint64_t)(n); \
+        STATS_LOCK(); \
+        if (n_ > stats.field) stats.field = n_; \
+        STATS_UNLOCK(); \
+    } while (0)
+#define STATS_ENCODE_ENTER() \
+    do { ++stats_encode_depth; STATS_MAX(max_depth, stats_encode_depth); } while (0)
+#define STATS_ENCODE_LEAVE() (--stats_encode_depth)
+#else
+#define STATS_ENABLED 0
+#define STATS_START(timer)
+#define STATS_STOP(field, timer)
+#define STATS_ADD(field, n)
+#define STATS_MAX(field, n)
+#define STATS_ENCODE_ENTER()
+#define STATS_ENCODE_LEAVE()
+#endif
+
+
+/*
+ * Decoded strings are built with PyUnicode_New() and filled directly
+ * instead of going through PyUnicode_FromStringAndSize(), which would scan
+ * and validate the UTF-8 rapidjson has just produced a second time.
+ */
 #ifdef PY3
-    if (!PyUnicode_Check(key)) {
-        pyobj = PyObject_Str(key);
-        if (pyobj == NULL) {
-            PyErr_SetString(PyExc_TypeError, "not support key type");
-            return false;
+/* length of the ASCII-only prefix of `str` */
+static inline size_t
+ascii_prefix(const char *str, size_t length)
+{
+    size_t i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+        if (_mm256_movemask_epi8(chunk)) {
+            break;
         }
-        utf8_item = PyUnicode_AsUTF8String(pyobj);
-    } else {
-        utf8_item = PyUnicode_AsUTF8String(key);
     }
-    key_string = PyBytes_AsString(utf8_item);
-#else
-    if (PyString_Check(key)) {
-        key_string = PyString_AsString(key);
-    } else if (PyUnicode_Check(key)) {
-        utf8_item = PyUnicode_AsUTF8String(key);
-        key_string = PyBytes_AsString(utf8_item);
-    } else {
-        PyObject *pyobj = PyObject_Str(key);
-        if (pyobj == NULL) {
-            PyErr_SetString(PyExc_TypeError, "not support key type");
-            return false;
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+        if (_mm_movemask_epi8(chunk)) {
+            break;
         }
-        Py_DECREF(key);
-        key_string = PyString_AsString(pyobj);
     }
 #endif
-    rapidjson::Value s;
-    s.SetString(key_string, doc.GetAllocator());
-
-    Py_XDECREF(pyobj);
-    Py_XDECREF(utf8_item);
-
-    rapidjson::Value _v;
-    if (false == pyobj2doc(value, _v, doc)) {
-        return false;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, str + i, sizeof(word));
+        if (word & 0x8080808080808080ULL) {
+            break;
+        }
     }
-    doc.AddMember(s, _v, doc.GetAllocator());
-    return true;
+    for (; i < length; ++i) {
+        if ((unsigned char)str[i] & 0x80) {
+            break;
+        }
+    }
+    return i;
 }
 
-static inline void
-_set_pyobj(PyObject *parent, PyObject *child, const char *key)
+/*
+ * Decode the multi-byte sequence at `s` into `*ch`; returns its length,
+ * or 0 for anything PyUnicode_DecodeUTF8 would reject (overlong forms,
+ * surrogates, code points above U+10FFFF, truncated sequences).
+ */
+static inline size_t
+utf8_decode_char(const unsigned char *s, size_t length, Py_UCS4 *ch)
 {
-    if (child && !parent) {
-        return;
-    }
+    unsigned char c = s[0];
 
-    if (PyList_Check(parent)) {
-        PyList_Append(parent, child);
-        if (child && child != Py_None) {
-            Py_XDECREF(child);
+#define UTF8_CONT(i) (length > (i) && (s[i] & 0xC0) == 0x80)
+    if (c >= 0xC2 && c <= 0xDF) {
+        if (!UTF8_CONT(1)) {
+            return 0;
         }
+        *ch = ((Py_UCS4)(c & 0x1F) << 6) | (s[1] & 0x3F);
+        return 2;
     }
-    else if (PyDict_Check(parent)) {
-#ifdef PY3
-        PyDict_SetItemString(parent, key, child);
-#else
-        PyObject *utf8key;
-        utf8key = PyUnicode_FromString(key);
-        if (!utf8key) {
-            return;
+    if (c >= 0xE0 && c <= 0xEF) {
+        if (!UTF8_CONT(1) || !UTF8_CONT(2) ||
+            (c == 0xE0 && s[1] < 0xA0) || (c == 0xED && s[1] > 0x9F)) {
+            return 0;
         }
-        PyDict_SetItem(parent, utf8key, child);
-        Py_DECREF(utf8key);
-#endif
-        if (child && child != Py_None) {
-            Py_XDECREF(child);
+        *ch = ((Py_UCS4)(c & 0x0F) << 12) | ((Py_UCS4)(s[1] & 0x3F) << 6) |
+              (s[2] & 0x3F);
+        return 3;
+    }
+    if (c >= 0xF0 && c <= 0xF4) {
+        if (!UTF8_CONT(1) || !UTF8_CONT(2) || !UTF8_CONT(3) ||
+            (c == 0xF0 && s[1] < 0x90) || (c == 0xF4 && s[1] > 0x8F)) {
+            return 0;
         }
+        *ch = ((Py_UCS4)(c & 0x07) << 18) | ((Py_UCS4)(s[1] & 0x3F) << 12) |
+              ((Py_UCS4)(s[2] & 0x3F) << 6) | (s[3] & 0x3F);
+        return 4;
     }
+#undef UTF8_CONT
+    return 0;
 }
 
+/* return a new str for `length` bytes of UTF-8 */
 static PyObject *
-_get_pyobj_from_array(rapidjson::Value::ConstValueIterator& doc,
-                      PyObject *root)
+utf8_to_unicode(const char *str, size_t length)
 {
-    PyObject *obj, *utf8item;
+    const unsigned char *s = (const unsigned char *)str;
+    size_t ascii = ascii_prefix(str, length);
+    size_t i, count;
+    Py_UCS4 ch = 0, maxchar = 127;
+    PyObject *obj;
 
-    switch (doc->GetType()) {
-    case rapidjson::kObjectType:
-        obj = PyDict_New();
-        for (rapidjson::Value::ConstMemberIterator itr = doc->MemberBegin();
-             itr != doc->MemberEnd(); ++itr) {
-            _get_pyobj_from_object(itr, obj, itr->name.GetString());
+    if (ascii == length) {
+        obj = PyUnicode_New((Py_ssize_t)length, 127);
+        if (obj != NULL) {
+            memcpy(PyUnicode_1BYTE_DATA(obj), str, length);
         }
-        break;
-    case rapidjson::kArrayType:
-        obj = PyList_New(0);
-        for (rapidjson::Value::ConstValueIterator itr = doc->Begin();
-             itr != doc->End(); ++itr) {
-            _get_pyobj_from_array(itr, obj);
-        }
-        break;
-    case rapidjson::kTrueType:
-        obj = PyBool_FromLong(1);
-        break;
-    case rapidjson::kFalseType:
-        obj = PyBool_FromLong(0);
-        break;
-    case rapidjson::kStringType:
-#ifdef PY3
-        obj = PyString_FromStringAndSize(doc->GetString(),
-                                         doc->GetStringLength());
-#else
-        utf8item = PyUnicode_FromStringAndSize(doc->GetString(),
-                                               doc->GetStringLength());
-        if (utf8item) {
-            obj = utf8item;
-        } else {
-            obj = PyString_FromStringAndSize(doc->GetString(),
-                                         doc->GetStringLength());
+        return obj;
+    }
+
+    /* first pass: the number of characters and the widest of them */
+    count = ascii;
+    for (i = ascii; i < length;) {
+        if (s[i] < 0x80) {
+            size_t run = ascii_prefix(str + i, length - i);
+            i += run;
+            count += run;
+            continue;
         }
-#endif
-        break;
-    case rapidjson::kNumberType:
-        if (doc->IsDouble()) {
-            obj = PyFloat_FromDouble(doc->GetDouble());
+        size_t n = utf8_decode_char(s + i, length - i, &ch);
+        if (n == 0) {
+            /* let the codec raise its UnicodeDecodeError */
+            return PyUnicode_DecodeUTF8(str, (Py_ssize_t)length, NULL);
         }
-        else {
-            obj = PyInt_FromLong(doc->GetInt64());
+        if (ch > maxchar) {
+            maxchar = ch;
         }
-        break;
-    case rapidjson::kNullType:
-        Py_INCREF(Py_None);
-        obj = Py_None;
-        break;
-    default:
-        PyErr_SetString(PyExc_RuntimeError, "not support type");
+        i += n;
+        count++;
+    }
+
+    obj = PyUnicode_New((Py_ssize_t)count, maxchar);
+    if (obj == NULL) {
         return NULL;
     }
 
-    _set_pyobj(root, obj, NULL);
+    /* second pass: write the characters in the kind PyUnicode_New chose */
+    int kind = PyUnicode_KIND(obj);
+    void *data = PyUnicode_DATA(obj);
+    size_t pos;
+    if (kind == PyUnicode_1BYTE_KIND) {
+        memcpy(data, str, ascii);
+    } else {
+        for (pos = 0; pos < ascii; ++pos) {
+            PyUnicode_WRITE(kind, data, pos, s[pos]);
+        }
+    }
+    for (i = pos = ascii; i < length; ++pos) {
+        if (s[i] < 0x80) {
+            PyUnicode_WRITE(kind, data, pos, s[i]);
+            i++;
+            continue;
+        }
+        i += utf8_decode_char(s + i, length - i, &ch);
+        PyUnicode_WRITE(kind, data, pos, ch);
+    }
+    return obj;
+}
+#else
+#define utf8_to_unicode(str, length) PyUnicode_FromStringAndSize(str, length)
+#endif
+
+
+/*
+ * Bounded, direct-mapped cache of decoded strings, kept across calls.
+ * Dict keys (and short string values when asked for) are looked up by hash,
+ * so repeated keys cost a lookup and the resulting dicts share key objects.
+ *
+ * The cache is shared by every interpreter in the process, but a str only
+ * ever serves the interpreter that created it: an entry is only a hit for
+ * its own interpreter, is never replaced by another one, and is dropped
+ * when its interpreter's module goes away (pyrapidjson_free). Free-threaded
+ * builds lock each slot on its own, so threads only contend on the same key.
+ */
+#define KEY_CACHE_SIZE 2048         /* number of slots, power of two */
+#define KEY_CACHE_MAX_LENGTH 64     /* longer strings are never cached */
+
+struct KeyCacheEntry {
+    uint64_t hash;
+    std::string bytes;
+    PyObject *str;
+    PyInterpreterState *interp;     /* owner of `str` */
+    Py_ssize_t hits;
+    Py_ssize_t misses;
+#ifdef Py_GIL_DISABLED
+    PyMutex mutex;
+#endif
+};
+
+static KeyCacheEntry key_cache[KEY_CACHE_SIZE];
+
+#ifdef Py_GIL_DISABLED
+#define KEY_CACHE_LOCK(entry) PyMutex_Lock(&(entry).mutex)
+#define KEY_CACHE_UNLOCK(entry) PyMutex_Unlock(&(entry).mutex)
+#else
+#define KEY_CACHE_LOCK(entry)
+#define KEY_CACHE_UNLOCK(entry)
+#endif
 
-    return root;
+static inline uint64_t
+key_cache_hash(const char *str, size_t length)
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
 }
 
+/* return a new reference to the str for `str`, from the cache when possible */
 static PyObject *
-_get_pyobj_from_object(rapidjson::Value::ConstMemberIterator& doc,
-                       PyObject *root,
-                       const char *key)
+key_cache_get(const char *str, rapidjson::SizeType length)
 {
-    PyObject *obj, *utf8item;
+    if (length > KEY_CACHE_MAX_LENGTH) {
+        return utf8_to_unicode(str, length);
+    }
 
-    switch (doc->value.GetType()) {
-    case rapidjson::kObjectType:
-        obj = PyDict_New();
-        for (rapidjson::Value::ConstMemberIterator itr = doc->value.MemberBegin();
-             itr != doc->value.MemberEnd(); ++itr) {
-            _get_pyobj_from_object(itr, obj, itr->name.GetString());
-        }
-        break;
-    case rapidjson::kArrayType:
-        obj = PyList_New(0);
-        for (rapidjson::Value::ConstValueIterator itr = doc->value.Begin();
-             itr != doc->value.End(); ++itr) {
-            _get_pyobj_from_array(itr, obj);
-        }
-        break;
-    case rapidjson::kTrueType:
-        obj = PyBool_FromLong(1);
-        break;
-    case rapidjson::kFalseType:
-        obj = PyBool_FromLong(0);
-        break;
-    case rapidjson::kStringType:
+    PyInterpreterState *interp = current_interpreter();
+    uint64_t hash = key_cache_hash(str, length);
+    KeyCacheEntry& entry = key_cache[hash & (KEY_CACHE_SIZE - 1)];
+
+    KEY_CACHE_LOCK(entry);
+    if (entry.str && entry.interp == interp && entry.hash == hash &&
+        entry.bytes.size() == length &&
+        memcmp(entry.bytes.data(), str, length) == 0) {
+        PyObject *obj = entry.str;
+        Py_INCREF(obj);
+        entry.hits++;
+        KEY_CACHE_UNLOCK(entry);
+        return obj;
+    }
+    KEY_CACHE_UNLOCK(entry);
+
+    PyObject *obj = utf8_to_unicode(str, length);
+    if (obj == NULL) {
+        return NULL;
+    }
 #ifdef PY3
-        obj = PyString_FromStringAndSize(doc->value.GetString(),
-                                         doc->value.GetStringLength());
-#else
-        utf8item = PyUnicode_FromStringAndSize(doc->value.GetString(),
-                                               doc->value.GetStringLength());
-        if (utf8item) {
-            obj = utf8item;
-        } else {
-            obj = PyString_FromStringAndSize(doc->value.GetString(),
-                                         doc->value.GetStringLength());
-        }
+    PyUnicode_InternInPlace(&obj);
 #endif
-        break;
-    case rapidjson::kNumberType:
-        if (doc->value.IsDouble()) {
-            obj = PyFloat_FromDouble(doc->value.GetDouble());
-        }
-        else {
-            obj = PyInt_FromLong(doc->value.GetInt64());
-        }
-        break;
-    case rapidjson::kNullType:
-        Py_INCREF(Py_None);
-        obj = Py_None;
-        break;
-    default:
-        PyErr_SetString(PyExc_RuntimeError, "not support type");
-        return NULL;
+    PyObject *old = NULL;
+    KEY_CACHE_LOCK(entry);
+    if (entry.str == NULL || entry.interp == interp) {
+        old = entry.str;
+        Py_INCREF(obj);
+        entry.str = obj;
+        entry.interp = interp;
+        entry.hash = hash;
+        entry.bytes.assign(str, length);
+        entry.misses++;
     }
-
-    _set_pyobj(root, obj, key);
+    KEY_CACHE_UNLOCK(entry);
+    Py_XDECREF(old);
     return obj;
 }
 
-static PyObject *
-doc2pyobj(rapidjson::Document& doc)
+/* drop the entries of `interp` */
+static void
+key_cache_clear(PyInterpreterState *interp)
 {
-    PyObject *root;
+    for (size_t i = 0; i < KEY_CACHE_SIZE; ++i) {
+        KeyCacheEntry& entry = key_cache[i];
+        PyObject *old = NULL;
 
-    if (doc.IsArray()) {
-        root = PyList_New(0);
-        for (rapidjson::Value::ConstValueIterator itr = doc.Begin();
-             itr != doc.End(); ++itr) {
-            _get_pyobj_from_array(itr, root);
-        }
-    }
-    else {
-        // Object
-        root = PyDict_New();
-        for (rapidjson::Value::ConstMemberIterator itr = doc.MemberBegin();
-             itr != doc.MemberEnd(); ++itr) {
-            _get_pyobj_from_object(itr, root, itr->name.GetString());
+        KEY_CACHE_LOCK(entry);
+        if (entry.interp == interp) {
+            old = entry.str;
+            entry.str = NULL;
+            entry.interp = NULL;
+            entry.bytes.clear();
+            entry.hits = 0;
+            entry.misses = 0;
         }
+        KEY_CACHE_UNLOCK(entry);
+        Py_XDECREF(old);
     }
-
-    return root;
 }
 
-static bool
-pyobj2doc(PyObject *object, rapidjson::Value& doc, rapidjson::Document& root)
-{
-    if (PyBool_Check(object)) {
-        if (Py_True == object) {
-	        doc.SetBool(true);
-        }
-        else {
-	        doc.SetBool(false);
+/*
+ * Projection for the decoder (loads(fields=...)): the object keys to keep at
+ * one level. `all` keeps the whole subtree; arrays are passed through, so a
+ * spec applies to each of their elements.
+ */
+struct FieldSpec {
+    bool all;
+    std::vector<std::string> names;
+    std::vector<FieldSpec> children;
+
+    FieldSpec() : all(false) {}
+
+    const FieldSpec *Find(const char *name, size_t length) const {
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (names[i].size() == length &&
+                memcmp(names[i].data(), name, length) == 0) {
+                return &children[i];
+            }
         }
+        return NULL;
     }
-    else if (Py_None == object) {
-        doc.SetNull();
+
+    FieldSpec *Add(const char *name, size_t length) {
+        FieldSpec *child = const_cast<FieldSpec *>(Find(name, length));
+        if (child == NULL) {
+            names.push_back(std::string(name, length));
+            children.push_back(FieldSpec());
+            child = &children.back();
+        }
+        return child;
     }
-    else if (PyFloat_Check(object)) {
-        doc.SetDouble(PyFloat_AsDouble(object));
+
+    void KeepAll() {
+        all = true;
+        names.clear();
+        children.clear();
     }
-    else if (PyInt_Check(object)) {
-        doc.SetInt64(PyLong_AsLong(object));
+};
+
+/*
+ * SAX handler for rapidjson::Reader that builds Python objects directly.
+ *
+ * Finished values are pushed on `stack`; `marks` remembers where each open
+ * container starts. Arrays are created at their final size on EndArray(),
+ * objects collect (key, value) pairs and are filled on EndObject().
+ */
+struct PyObjectHandler {
+    std::vector<PyObject *> stack;
+    std::vector<size_t> marks;
+    bool cache_values;
+
+    /*
+     * Projection state. `spec` applies to the next value (NULL keeps all of
+     * it), `specs` holds the spec of each open container. Values dropped by
+     * the projection are never converted: `drop` skips the next value and
+     * `skip` counts the depth inside a dropped container.
+     */
+    const FieldSpec *fields;
+    const FieldSpec *spec;
+    std::vector<const FieldSpec *> specs;
+    bool drop;
+    unsigned skip;
+
+    PyObjectHandler(bool cache_values = false, const FieldSpec *fields = NULL)
+        : cache_values(cache_values), fields(fields) {
+        Reset();
     }
-    else if (PyString_Check(object)) {
-        doc.SetString(PyString_AsString(object), PyString_GET_SIZE(object));
+
+    ~PyObjectHandler() {
+        Reset();
     }
-    else if (PyUnicode_Check(object)) {
-        PyObject *utf8_item = PyUnicode_AsUTF8String(object);
-        if (!utf8_item) {
-            PyErr_SetString(PyExc_RuntimeError, "codec error.");
-            return false;
+
+    /* drop whatever a failed parse left behind, keeping the capacity */
+    void Reset() {
+        for (size_t i = 0; i < stack.size(); ++i) {
+            Py_XDECREF(stack[i]);
         }
-#ifdef PY3
-        doc.SetString(PyBytes_AsString(utf8_item), PyBytes_GET_SIZE(utf8_item), root.GetAllocator());
-#else
-        doc.SetString(PyString_AsString(utf8_item), PyString_GET_SIZE(utf8_item), root.GetAllocator());
-#endif
-        Py_XDECREF(utf8_item);
+        stack.clear();
+        marks.clear();
+        specs.clear();
+        spec = RootSpec();
+        drop = false;
+        skip = 0;
     }
-    else if (PyTuple_Check(object)) {
-        int len = PyTuple_Size(object), i;
 
-        doc.SetArray();
-        rapidjson::Value _v;
-        for (i = 0; i < len; ++i) {
-            PyObject *elm = PyTuple_GetItem(object, i);
-            if (false == pyobj2doc(elm, _v, root)) {
-                return false;
-            }
-            doc.PushBack(_v, root.GetAllocator());
+    /* the spec of a top-level value */
+    const FieldSpec *RootSpec() const {
+        return (fields != NULL && !fields->all) ? fields : NULL;
+    }
+
+    /* give back the stacks once they hold more than `max_bytes` */
+    void Trim(size_t max_bytes) {
+        if (stack.capacity() * sizeof(PyObject *) > max_bytes) {
+            std::vector<PyObject *>().swap(stack);
+        }
+        if (marks.capacity() * sizeof(size_t) > max_bytes) {
+            std::vector<size_t>().swap(marks);
+        }
+        if (specs.capacity() * sizeof(const FieldSpec *) > max_bytes) {
+            std::vector<const FieldSpec *>().swap(specs);
         }
     }
-    else if (PyList_Check(object)) {
-        int len = PyList_Size(object), i;
 
-        doc.SetArray();
-        rapidjson::Value _v;
-        for (i = 0; i < len; ++i) {
-            PyObject *elm = PyList_GetItem(object, i);
-            if (false == pyobj2doc(elm, _v, root)) {
-                return false;
-            }
-            doc.PushBack(_v, root.GetAllocator());
+    /* return a new reference to the parsed root value */
+    PyObject *Result() {
+        PyObject *root;
+        if (stack.size() != 1) {
+            return NULL;
         }
+        root = stack.back();
+        stack.pop_back();
+        return root;
     }
-    else if (PyDict_Check(object)) {
-        doc.SetObject();
-        PyObject *key, *value;
-        Py_ssize_t pos = 0;
-        while (PyDict_Next(object, &pos, &key, &value)) {
-            if (false == pyobj2doc_pair(key, value, doc, root)) {
-                return false;
-            }
+
+    bool Push(PyObject *obj) {
+        if (obj == NULL) {
+            return false;
         }
+        stack.push_back(obj);
+        return true;
     }
-    else {
-        PyErr_SetString(PyExc_RuntimeError, "invalid python object");
+
+    /* true when the projection drops the scalar being parsed */
+    bool Skipped() {
+        if (skip) {
+            return true;
+        }
+        if (drop) {
+            drop = false;
+            return true;
+        }
         return false;
     }
 
-    return true;
-}
+    /* true when the projection drops the container being opened */
+    bool SkippedStart() {
+        if (skip) {
+            ++skip;
+            return true;
+        }
+        if (drop) {
+            drop = false;
+            skip = 1;
+            return true;
+        }
+        specs.push_back(spec);
+        return false;
+    }
 
-static bool
-pyobj2doc(PyObject *object, rapidjson::Document& doc)
-{
-    if (PyBool_Check(object)) {
-        if (Py_True == object) {
-	        doc.SetBool(true);
+    /* true when a dropped container is being closed */
+    bool SkippedEnd() {
+        if (skip) {
+            --skip;
+            return true;
         }
-        else {
-	        doc.SetBool(false);
+        specs.pop_back();
+        spec = specs.empty() ? RootSpec() : specs.back();
+        return false;
+    }
+
+    bool Null() {
+        if (Skipped()) {
+            return true;
         }
+        Py_INCREF(Py_None);
+        return Push(Py_None);
     }
-    else if (Py_None == object) {
-        doc.SetNull();
+    bool Bool(bool b) {
+        return Skipped() || Push(PyBool_FromLong(b));
     }
-    else if (PyFloat_Check(object)) {
-        doc.SetDouble(PyFloat_AsDouble(object));
+    bool Int(int i) {
+        return Skipped() || Push(PyInt_FromLong(i));
     }
-    else if (PyInt_Check(object)) {
-        doc.SetInt64(PyLong_AsLong(object));
+    bool Uint(unsigned u) {
+        return Skipped() || Push(PyLong_FromUnsignedLong(u));
     }
-    else if (PyString_Check(object)) {
-        doc.SetString(PyString_AsString(object), PyString_GET_SIZE(object));
+    bool Int64(int64_t i) {
+        return Skipped() || Push(PyLong_FromLongLong(i));
     }
-    else if (PyUnicode_Check(object)) {
-        PyObject *utf8_item;
-        utf8_item = PyUnicode_AsUTF8String(object);
-        if (!utf8_item) {
-            PyErr_SetString(PyExc_RuntimeError, "codec error.");
-            return false;
+    bool Uint64(uint64_t u) {
+        return Skipped() || Push(PyLong_FromUnsignedLongLong(u));
+    }
+    bool Double(double d) {
+        return Skipped() || Push(PyFloat_FromDouble(d));
+    }
+    bool RawNumber(const char *str, rapidjson::SizeType length, bool copy) {
+        return String(str, length, copy);
+    }
+    bool String(const char *str, rapidjson::SizeType length, bool copy) {
+        PyObject *utf8item;
+        if (Skipped()) {
+            return true;
+        }
+        if (cache_values) {
+            utf8item = key_cache_get(str, length);
+        } else {
+            utf8item = utf8_to_unicode(str, length);
+        }
+#ifndef PY3
+        if (utf8item == NULL) {
+            PyErr_Clear();
+            utf8item = PyString_FromStringAndSize(str, length);
         }
-#ifdef PY3
-        doc.SetString(PyBytes_AsString(utf8_item), PyBytes_GET_SIZE(utf8_item), doc.GetAllocator());
-#else
-        doc.SetString(PyString_AsString(utf8_item), PyString_GET_SIZE(utf8_item), doc.GetAllocator());
 #endif
-        Py_XDECREF(utf8_item);
+        return Push(utf8item);
     }
-    else if (PyTuple_Check(object)) {
-        int len = PyTuple_Size(object), i;
-        doc.SetArray();
-        rapidjson::Value _v;
-        for (i = 0; i < len; ++i) {
-            PyObject *elm = PyTuple_GetItem(object, i);
-            if (false == pyobj2doc(elm, _v, doc)) {
-                return false;
+    bool Key(const char *str, rapidjson::SizeType length, bool copy) {
+        const FieldSpec *object_spec;
+
+        if (skip) {
+            return true;
+        }
+        object_spec = specs.back();
+        if (object_spec != NULL) {
+            spec = object_spec->Find(str, length);
+            if (spec == NULL) {
+                drop = true;
+                return true;
+            }
+            if (spec->all) {
+                spec = NULL;
             }
-            doc.PushBack(_v, doc.GetAllocator());
         }
+        return Push(key_cache_get(str, length));
     }
-    else if (PyList_Check(object)) {
-        int len = PyList_Size(object), i;
-        doc.SetArray();
-        rapidjson::Value _v;
-        for (i = 0; i < len; ++i) {
-            PyObject *elm = PyList_GetItem(object, i);
-            if (false == pyobj2doc(elm, _v, doc)) {
-                return false;
-            }
-            doc.PushBack(_v, doc.GetAllocator());
+
+    bool StartObject() {
+        if (!SkippedStart()) {
+            marks.push_back(stack.size());
+            STATS_MAX(max_depth, marks.size());
         }
+        return true;
     }
-    else if (PyDict_Check(object)) {
-        doc.SetObject();
-        PyObject *key, *value;
-        Py_ssize_t pos = 0;
-        while (PyDict_Next(object, &pos, &key, &value)) {
-            if (false == pyobj2doc_pair(key, value, doc)) {
-                return false;
+    bool EndObject(rapidjson::SizeType memberCount) {
+        if (SkippedEnd()) {
+            return true;
+        }
+        size_t mark = marks.back();
+        PyObject *obj = PyDict_New();
+        bool ok = (obj != NULL);
+
+        marks.pop_back();
+        for (size_t i = mark; i < stack.size(); i += 2) {
+            if (ok && PyDict_SetItem(obj, stack[i], stack[i + 1]) < 0) {
+                ok = false;
             }
+            Py_DECREF(stack[i]);
+            Py_DECREF(stack[i + 1]);
+        }
+        stack.resize(mark);
+        if (!ok) {
+            Py_XDECREF(obj);
+            return false;
         }
+        return Push(obj);
     }
-    else {
-        PyErr_SetString(PyExc_RuntimeError, "invalid python object");
-        return false;
+
+    bool StartArray() {
+        if (!SkippedStart()) {
+            marks.push_back(stack.size());
+            STATS_MAX(max_depth, marks.size());
+        }
+        return true;
     }
+    bool EndArray(rapidjson::SizeType elementCount) {
+        if (SkippedEnd()) {
+            return true;
+        }
+        size_t mark = marks.back();
+        PyObject *obj = PyList_New(stack.size() - mark);
 
-    return true;
-}
+        marks.pop_back();
+        if (obj == NULL) {
+            return false;
+        }
+        /* PyList_SET_ITEM steals the references held by the stack */
+        for (size_t i = mark; i < stack.size(); ++i) {
+            PyList_SET_ITEM(obj, i - mark, stack[i]);
+        }
+        stack.resize(mark);
+        return Push(obj);
+    }
+};
 
-static PyObject *
-pyobj2pystring(PyObject *pyjson)
-{
-    rapidjson::Document doc;
+/* where a document failed validation against a Schema */
+struct SchemaFailure {
+    std::string keyword;
+    std::string schema_pointer;
+    std::string document_pointer;
 
-    if (false == pyobj2doc(pyjson, doc)) {
-        return NULL;
+    /*
+     * A GenericSchemaValidator or SchemaValidatingReader; no GIL needed.
+     * false if no keyword failed: the validator also turns invalid when
+     * its output handler fails, and then has no keyword to report.
+     */
+    template <typename Validator>
+    bool Record(Validator& validator) {
+        rapidjson::StringBuffer sb;
+        const char *invalid = validator.GetInvalidSchemaKeyword();
+
+        if (invalid == NULL) {
+            return false;
+        }
+        keyword = invalid;
+        validator.GetInvalidSchemaPointer().StringifyUriFragment(sb);
+        schema_pointer.assign(sb.GetString(), sb.GetSize());
+        sb.Clear();
+        validator.GetInvalidDocumentPointer().StringifyUriFragment(sb);
+        document_pointer.assign(sb.GetString(), sb.GetSize());
+        return true;
     }
+};
 
-    rapidjson::StringBuffer buffer;
-    rapidjson::Writer<rapidjson::StringBuffer, rapidjson::Document::EncodingType, rapidjson::ASCII<> > writer(buffer);
-    doc.Accept(writer);
-    std::string s = buffer.GetString();
+/*
+ * rapidjson.ValidationError, a ValueError. Static like the other types here:
+ * PyErr_NewException() would make a heap type owned by whichever
+ * interpreter imported the module first.
+ */
+static PyTypeObject ValidationErrorType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "rapidjson.ValidationError",    /* tp_name */
+    sizeof(PyBaseExceptionObject),  /* tp_basicsize */
+};
+
+/* raise rapidjson.ValidationError carrying the pointers of `failure` */
+static void
+raise_validation_error(const SchemaFailure& failure)
+{
+    static const char *names[] = {"keyword", "schema_pointer", "document_pointer"};
+    const std::string *values[] = {&failure.keyword, &failure.schema_pointer,
+                                   &failure.document_pointer};
+    std::string message = "document at '" + failure.document_pointer +
+        "' fails '" + failure.keyword + "' of schema at '" +
+        failure.schema_pointer + "'";
+    PyObject *exc, *value;
 
-    return PyString_FromStringAndSize(s.data(), s.length());
+    exc = PyObject_CallFunction((PyObject *)&ValidationErrorType, (char *)"s",
+                                message.c_str());
+    if (exc == NULL) {
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        value = PyString_FromStringAndSize(values[i]->data(), values[i]->size());
+        if (value == NULL || PyObject_SetAttrString(exc, names[i], value) < 0) {
+            Py_XDECREF(value);
+            Py_DECREF(exc);
+            return;
+        }
+        Py_DECREF(value);
+    }
+    PyErr_SetObject((PyObject *)&ValidationErrorType, exc);
+    Py_DECREF(exc);
 }
 
+template <unsigned parseFlags, typename InputStream>
 static PyObject *
-_doc2pyobj(rapidjson::Document& doc, char *text)
+stream2pyobj(InputStream& is, PyObjectHandler& handler,
+             rapidjson::Reader& reader,
+             const rapidjson::SchemaDocument *schema = NULL)
 {
-    int is_float;
-    unsigned int offset;
-    PyObject *pyjson;
+    SchemaFailure failure;
+    bool valid = true;
 
-    if (!(doc.IsArray() || doc.IsObject())) {
-        switch (text[0]) {
-        case 't':
-            return PyBool_FromLong(1);
-        case 'f':
-            return PyBool_FromLong(0);
-        case 'n':
-            Py_RETURN_NONE;
-        case '"':
-#ifdef PY3
-            return PyString_FromStringAndSize(text + 1, strlen(text) - 2);
-#else
-            PyObject *utf8item;
-            utf8item = PyUnicode_FromStringAndSize(text + 1, strlen(text) - 2);
-            if (utf8item) {
-                return utf8item;
-            } else {
-                return PyString_FromStringAndSize(text + 1, strlen(text) - 2);
-            }
-#endif
-        default:
-            is_float = 0;
-            for (offset = 0; offset < strlen(text); offset++) {
-                switch (text[offset]) {
-                    case '.':
-                    case 'e':
-                    case 'E':
-                        is_float = 1;
-                        break;
-                }
-                if (is_float) break;
-            }
-            if (is_float) {
-                pyjson = PyFloat_FromDouble(atof(text));
-            }
+    STATS_START(timer);
+    if (schema) {
+        /*
+         * Validated as the events go by on their way to the handler; an
+         * invalid document stops the parse, and the handler drops what it
+         * has built so far.
+         */
+        rapidjson::GenericSchemaValidator<rapidjson::SchemaDocument,
+                                          PyObjectHandler> validator(*schema, handler);
+
+        reader.Parse<parseFlags>(is, validator);
+        /* a failed handler leaves the validator invalid too; its error wins */
+        if (!PyErr_Occurred() && !validator.IsValid()) {
+            valid = !failure.Record(validator);
+        }
+    } else {
+        reader.Parse<parseFlags>(is, handler);
+    }
+    STATS_STOP(decode_ns, timer);
+    STATS_ADD(decode_calls, 1);
+    STATS_ADD(bytes_in, is.Tell());
+    if (PyErr_Occurred()) {
+        return NULL;
+    }
+    if (!valid) {
+        raise_validation_error(failure);
+        return NULL;
+    }
+    if (reader.HasParseError()) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ValueError,
+                            GetParseError_En(reader.GetParseErrorCode()));
+        }
+        return NULL;
+    }
+
+    return handler.Result();
+}
+
+template <unsigned parseFlags, typename InputStream>
+static PyObject *
+stream2pyobj(InputStream& is, PyObjectHandler& handler,
+             const rapidjson::SchemaDocument *schema = NULL)
+{
+    rapidjson::Reader reader;
+
+    return stream2pyobj<parseFlags>(is, handler, reader, schema);
+}
+
+/* MemoryStream stops at an embedded NUL; the rest must not be ignored */
+static inline bool
+check_consumed(const rapidjson::MemoryStream& is, size_t length)
+{
+    if (is.Tell() != length) {
+        PyErr_SetString(PyExc_ValueError,
+                        GetParseError_En(rapidjson::kParseErrorDocumentRootNotSingular));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Parse `length` bytes of JSON text into `doc`, with the GIL released when
+ * `nogil` is set (the caller keeps `text` alive), validating it against
+ * `schema` on the way when one is given. false with ValueError (or
+ * ValidationError) set on a parse error.
+ */
+template <unsigned parseFlags>
+static bool
+buffer2doc(rapidjson::Document& doc, const char *text, size_t length,
+           bool nogil, const rapidjson::SchemaDocument *schema = NULL)
+{
+    rapidjson::MemoryStream is(text, length);
+    rapidjson::ParseResult result;
+    SchemaFailure failure;
+    bool valid = true;
+    PyThreadState *state = NULL;
+
+    STATS_START(timer);
+    if (nogil) {
+        state = PyEval_SaveThread();
+    }
+    if (schema) {
+        rapidjson::SchemaValidatingReader<parseFlags, rapidjson::MemoryStream,
+                                          rapidjson::UTF8<> > reader(is, *schema);
+
+        doc.Populate(reader);
+        result = reader.GetParseResult();
+        if (!reader.IsValid()) {
+            valid = !failure.Record(reader);
+        }
+    } else {
+        doc.ParseStream<parseFlags>(is);
+        result = doc;
+    }
+    if (nogil) {
+        PyEval_RestoreThread(state);
+    }
+    STATS_STOP(parse_ns, timer);
+    STATS_ADD(decode_calls, 1);
+    STATS_ADD(bytes_in, is.Tell());
+    STATS_ADD(allocator_bytes, doc.GetAllocator().Capacity());
+
+    if (!valid) {
+        raise_validation_error(failure);
+        return false;
+    }
+    if (result.IsError()) {
+        PyErr_SetString(PyExc_ValueError, GetParseError_En(result.Code()));
+        return false;
+    }
+    return check_consumed(is, length);
+}
+
+/*
+ * Decode `length` bytes of JSON text. With `nogil`, the text is parsed into
+ * a rapidjson::Document with the GIL released, and only the conversion to
+ * Python objects runs under the GIL.
+ *
+ * A Decoder passes its own `reader` and `allocator` so their memory is
+ * reused from call to call; otherwise both are created here. With
+ * `schema`, the text is validated in the same pass that parses it.
+ */
+template <unsigned parseFlags>
+static PyObject *
+buffer2pyobj(const char *text, size_t length, PyObjectHandler& handler,
+             bool nogil, rapidjson::Reader *reader = NULL,
+             rapidjson::Document::AllocatorType *allocator = NULL,
+             const rapidjson::SchemaDocument *schema = NULL)
+{
+    if (nogil) {
+        rapidjson::Document doc(allocator);
+
+        if (!buffer2doc<parseFlags>(doc, text, length, true, schema)) {
+            return NULL;
+        }
+        STATS_START(timer);
+        bool ok = doc.Accept(handler);
+        STATS_STOP(convert_ns, timer);
+        if (!ok) {
+            return NULL;
+        }
+        return handler.Result();
+    }
+
+    rapidjson::MemoryStream is(text, length);
+    PyObject *ret = reader
+        ? stream2pyobj<parseFlags>(is, handler, *reader, schema)
+        : stream2pyobj<parseFlags>(is, handler, schema);
+    if (ret != NULL && !check_consumed(is, length)) {
+        Py_CLEAR(ret);
+    }
+    return ret;
+}
+
+/*
+ * The UTF-8 text of a loads() argument, borrowed without copying: str
+ * through its cached UTF-8 representation, anything else (bytes,
+ * bytearray, memoryview, mmap, ...) through the buffer protocol. The
+ * buffer stays exported, so it cannot be resized or closed, until the
+ * TextBuffer goes away.
+ */
+class TextBuffer {
+public:
+    const char *data;
+    Py_ssize_t length;
+
+    TextBuffer() : data(NULL), length(0), owner_(NULL), has_view_(false) {}
+
+    ~TextBuffer() {
+        if (has_view_) {
+            PyBuffer_Release(&view_);
+        }
+        Py_XDECREF(owner_);
+    }
+
+    bool Get(PyObject *obj) {
+        if (PyUnicode_Check(obj)) {
+#ifdef PY3
+            data = PyUnicode_AsUTF8AndSize(obj, &length);
+            return data != NULL;
+#else
+            owner_ = PyUnicode_AsUTF8String(obj);
+            if (owner_ == NULL) {
+                return false;
+            }
+            data = PyString_AS_STRING(owner_);
+            length = PyString_GET_SIZE(owner_);
+            return true;
+#endif
+        }
+        if (!PyObject_CheckBuffer(obj)) {
+            PyErr_Format(PyExc_TypeError,
+                         "expected str or bytes-like object, not %.200s",
+                         Py_TYPE(obj)->tp_name);
+            return false;
+        }
+        if (PyObject_GetBuffer(obj, &view_, PyBUF_SIMPLE) < 0) {
+            return false;
+        }
+        has_view_ = true;
+        data = (const char *)view_.buf;
+        length = view_.len;
+        return true;
+    }
+
+private:
+    TextBuffer(const TextBuffer&);
+    TextBuffer& operator=(const TextBuffer&);
+
+    PyObject *owner_;
+    bool has_view_;
+    Py_buffer view_;
+};
+
+/* whether to parse `length` bytes with the GIL released */
+static bool
+use_nogil(PyObject *release_gil, size_t length)
+{
+    if (release_gil == NULL || release_gil == Py_None) {
+        return length >= NOGIL_THRESHOLD;
+    }
+    return PyObject_IsTrue(release_gil) == 1;
+}
+
+static bool fields2spec(PyObject *fields, FieldSpec& spec);
+
+/* add the keys of a nested spec such as {"a": True, "b": {"c": True}} */
+static bool
+fields_dict2spec(PyObject *fields, FieldSpec& spec)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    TextBuffer name;
+    bool ok;
+
+    while (PyDict_Next(fields, &pos, &key, &value)) {
+        if (!PyUnicode_Check(key) && !PyString_Check(key)) {
+            PyErr_Format(PyExc_TypeError,
+                         "fields keys must be str, not %.200s",
+                         Py_TYPE(key)->tp_name);
+            return false;
+        }
+        if (!PyDict_Check(value)) {
+            int keep = PyObject_IsTrue(value);
+            if (keep < 0) {
+                return false;
+            }
+            if (keep == 0) {
+                continue;
+            }
+        }
+        if (!name.Get(key)) {
+            return false;
+        }
+        FieldSpec *child = spec.Add(name.data, (size_t)name.length);
+        if (child->all) {
+            continue;
+        }
+        if (!PyDict_Check(value)) {
+            child->KeepAll();
+            continue;
+        }
+        if (Py_EnterRecursiveCall(" while reading fields")) {
+            return false;
+        }
+        ok = fields_dict2spec(value, *child);
+        Py_LeaveRecursiveCall();
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* add one JSON Pointer; its tokens name object keys only */
+static bool
+fields_pointer2spec(PyObject *pointer, FieldSpec& spec)
+{
+    TextBuffer source;
+    FieldSpec *node = &spec;
+
+    if (!PyUnicode_Check(pointer) && !PyString_Check(pointer)) {
+        PyErr_Format(PyExc_TypeError,
+                     "fields must contain JSON Pointer strings, not %.200s",
+                     Py_TYPE(pointer)->tp_name);
+        return false;
+    }
+    if (!source.Get(pointer)) {
+        return false;
+    }
+    rapidjson::Pointer ptr(source.data, (size_t)source.length);
+    if (!ptr.IsValid()) {
+        PyErr_Format(PyExc_ValueError, "invalid JSON Pointer at offset %d",
+                     (int)ptr.GetParseErrorOffset());
+        return false;
+    }
+
+    const rapidjson::Pointer::Token *tokens = ptr.GetTokens();
+    for (size_t i = 0; i < ptr.GetTokenCount() && !node->all; ++i) {
+        node = node->Add(tokens[i].name, tokens[i].length);
+    }
+    node->KeepAll();
+    return true;
+}
+
+/*
+ * Build the projection for the `fields` argument of the decoders: a nested
+ * dict of keys, a JSON Pointer string, or an iterable of JSON Pointers.
+ */
+static bool
+fields2spec(PyObject *fields, FieldSpec& spec)
+{
+    PyObject *iter, *item;
+
+    if (PyDict_Check(fields)) {
+        return fields_dict2spec(fields, spec);
+    }
+    if (PyUnicode_Check(fields) || PyString_Check(fields)) {
+        return fields_pointer2spec(fields, spec);
+    }
+
+    iter = PyObject_GetIter(fields);
+    if (iter == NULL) {
+        return false;
+    }
+    while ((item = PyIter_Next(iter)) != NULL) {
+        bool ok = fields_pointer2spec(item, spec);
+        Py_DECREF(item);
+        if (!ok) {
+            Py_DECREF(iter);
+            return false;
+        }
+    }
+    Py_DECREF(iter);
+    return !PyErr_Occurred();
+}
+
+#ifdef PY3
+/*
+ * The UTF-8 text of a str without a temporary bytes object: a compact
+ * ASCII str is its own UTF-8, any other has it cached on the object by
+ * PyUnicode_AsUTF8AndSize. NULL with an exception set on error.
+ */
+static inline const char *
+unicode2utf8(PyObject *str, Py_ssize_t *length)
+{
+    if (PyUnicode_IS_COMPACT_ASCII(str)) {
+        *length = PyUnicode_GET_LENGTH(str);
+        return (const char *)PyUnicode_1BYTE_DATA(str);
+    }
+    return PyUnicode_AsUTF8AndSize(str, length);
+}
+#endif
+
+/*
+ * The UTF-8 text of a dict key: str as it is, anything else through
+ * str(). data stays valid as long as both the KeyText and the key live.
+ */
+class KeyText {
+public:
+    const char *data;
+    Py_ssize_t length;
+
+    KeyText() : data(NULL), length(0), owner_(NULL) {}
+
+    ~KeyText() {
+        Py_XDECREF(owner_);
+    }
+
+    bool Get(PyObject *key) {
+#ifdef PY3
+        if (!PyUnicode_Check(key)) {
+            if ((owner_ = PyObject_Str(key)) == NULL) {
+                PyErr_SetString(PyExc_TypeError, "not support key type");
+                return false;
+            }
+            key = owner_;
+        }
+        data = unicode2utf8(key, &length);
+        return data != NULL;
+#else
+        if (PyUnicode_Check(key)) {
+            if ((owner_ = PyUnicode_AsUTF8String(key)) == NULL) {
+                return false;
+            }
+            key = owner_;
+        } else if (!PyString_Check(key)) {
+            if ((owner_ = PyObject_Str(key)) == NULL) {
+                PyErr_SetString(PyExc_TypeError, "not support key type");
+                return false;
+            }
+            key = owner_;
+        }
+        data = PyString_AS_STRING(key);
+        length = PyString_GET_SIZE(key);
+        return true;
+#endif
+    }
+
+private:
+    KeyText(const KeyText&);
+    KeyText& operator=(const KeyText&);
+
+    PyObject *owner_;
+};
+
+/*
+ * Writer::String() (or Key()) with ValueError set when it fails, as it
+ * does for text that is not valid UTF-8 when escaping to ASCII.
+ */
+template <typename Writer>
+static inline bool
+write_string(Writer& writer, const char *str, Py_ssize_t length, bool key = false)
+{
+    bool ok = key ? writer.Key(str, (rapidjson::SizeType)length)
+                  : writer.String(str, (rapidjson::SizeType)length);
+
+    if (!ok) {
+        PyErr_SetString(PyExc_ValueError, "string is not valid UTF-8");
+    }
+    return ok;
+}
+
+template <typename Writer>
+static inline bool
+pyobj2writer_key(PyObject *key, Writer& writer)
+{
+    KeyText text;
+
+    if (!text.Get(key)) {
+        return false;
+    }
+    return write_string(writer, text.data, text.length, true);
+}
+
+/* orders key indices by the UTF-8 bytes of the keys, i.e. by code point */
+struct KeyTextLess {
+    const KeyText *keys;
+
+    explicit KeyTextLess(const KeyText *keys) : keys(keys) {}
+
+    bool operator()(size_t a, size_t b) const {
+        Py_ssize_t length = keys[a].length < keys[b].length ? keys[a].length : keys[b].length;
+        int cmp = memcmp(keys[a].data, keys[b].data, (size_t)length);
+        return cmp != 0 ? cmp < 0 : keys[a].length < keys[b].length;
+    }
+};
+
+template <typename Writer>
+static inline bool
+pyobj2writer_long(PyObject *object, Writer& writer)
+{
+    int overflow;
+    PY_LONG_LONG value = PyLong_AsLongLongAndOverflow(object, &overflow);
+
+    if (value == -1 && PyErr_Occurred()) {
+        return false;
+    }
+    if (!overflow) {
+        return writer.Int64(value);
+    }
+    if (overflow > 0) {
+        unsigned PY_LONG_LONG uvalue = PyLong_AsUnsignedLongLong(object);
+        if (!(uvalue == (unsigned PY_LONG_LONG)-1 && PyErr_Occurred())) {
+            return writer.Uint64(uvalue);
+        }
+        PyErr_Clear();
+    }
+
+    /* out of 64bit range, write the decimal digits as they are */
+    PyObject *digits = PyObject_Str(object);
+    if (digits == NULL) {
+        return false;
+    }
+#ifdef PY3
+    Py_ssize_t length;
+    const char *str = PyUnicode_AsUTF8AndSize(digits, &length);
+#else
+    Py_ssize_t length = PyString_GET_SIZE(digits);
+    const char *str = PyString_AS_STRING(digits);
+#endif
+    bool ret = (str != NULL) &&
+        writer.RawValue(str, (size_t)length, rapidjson::kNumberType);
+    Py_DECREF(digits);
+    return ret;
+}
+
+/* the TargetEncoding a Writer was instantiated with */
+template <typename Writer>
+struct WriterTarget;
+
+template <typename OutputStream, typename SourceEncoding, typename TargetEncoding,
+          typename StackAllocator, unsigned writeFlags>
+struct WriterTarget<rapidjson::Writer<OutputStream, SourceEncoding, TargetEncoding,
+                                      StackAllocator, writeFlags> > {
+    typedef TargetEncoding Encoding;
+};
+
+/* a list whose keys needed escaping this often more than they were reused gives up */
+#define KEY_SHAPE_MAX_MISSES 64
+
+/*
+ * The key sequence of the last dict seen in a list, each key escaped and
+ * quoted for the target encoding. Rows of a table share their key objects
+ * (literals, interned names, the decoder's key cache), so for each row
+ * after the first the keys are matched by identity and copied into the
+ * output with Writer::RawValue(); only the values are encoded. A key that
+ * differs replaces the rest of the shape from its position on.
+ */
+struct KeyShape {
+    std::vector<PyObject *> keys;   /* strong references */
+    std::vector<char> fragments;    /* escaped keys back to back */
+    std::vector<size_t> ends;
+    size_t hits;
+    size_t misses;
+
+    KeyShape() : hits(0), misses(0) {}
+
+    ~KeyShape() {
+        Truncate(0);
+    }
+
+    bool Usable() const {
+        return misses < KEY_SHAPE_MAX_MISSES || hits >= misses;
+    }
+
+    void Truncate(size_t size) {
+        for (size_t i = size; i < keys.size(); ++i) {
+            Py_DECREF(keys[i]);
+        }
+        keys.resize(size);
+        ends.resize(size);
+        fragments.resize(size ? ends[size - 1] : 0);
+    }
+
+    /* the escaped key at position `i`, stored there first if it is not yet */
+    template <typename Writer>
+    bool Get(size_t i, PyObject *key, const char **fragment, size_t *length) {
+        if (i < keys.size() && keys[i] == key) {
+            hits++;
+        } else if (!Set<Writer>(i, key)) {
+            return false;
+        }
+        size_t start = i ? ends[i - 1] : 0;
+        *fragment = &fragments[start];
+        *length = ends[i] - start;
+        return true;
+    }
+
+    /* false (without an exception) for anything but a plain str key */
+    template <typename Writer>
+    bool Set(size_t i, PyObject *key) {
+        typedef typename WriterTarget<Writer>::Encoding Encoding;
+        rapidjson::StringBuffer sb;
+        rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, Encoding> escaper(sb);
+        const char *str;
+        Py_ssize_t length;
+
+        Truncate(i < keys.size() ? i : keys.size());
+        if (keys.size() != i) {
+            return false;
+        }
+#ifdef PY3
+        if (!PyUnicode_CheckExact(key)) {
+            return false;
+        }
+        str = unicode2utf8(key, &length);
+        if (str == NULL) {
+            PyErr_Clear();
+            return false;
+        }
+#else
+        if (!PyString_CheckExact(key)) {
+            return false;
+        }
+        str = PyString_AS_STRING(key);
+        length = PyString_GET_SIZE(key);
+#endif
+        /* left to pyobj2writer_key() to report */
+        if (!escaper.String(str, (rapidjson::SizeType)length)) {
+            return false;
+        }
+        misses++;
+        fragments.insert(fragments.end(), sb.GetString(), sb.GetString() + sb.GetSize());
+        ends.push_back(fragments.size());
+        Py_INCREF(key);
+        keys.push_back(key);
+        return true;
+    }
+};
+
+/* a dict in a list, its keys taken from the list's KeyShape */
+template <typename Writer>
+static bool
+pyobj2writer_row(PyObject *dict, Writer& writer, KeyShape& shape,
+                 const EncodeOptions& options)
+{
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    size_t i = 0;
+    bool shaped = true;
+    bool ok = true;
+    const char *fragment;
+    size_t length;
+
+    if (!shape.Usable() || options.sort_keys) {
+        return pyobj2writer(dict, writer, options);
+    }
+
+    if (Py_EnterRecursiveCall(" while encoding a JSON object")) {
+        return false;
+    }
+    STATS_ENCODE_ENTER();
+    writer.StartObject();
+    Py_BEGIN_CRITICAL_SECTION(dict);
+    while (ok && PyDict_Next(dict, &pos, &key, &value)) {
+        Py_INCREF(key);
+        Py_INCREF(value);
+        /* once a key cannot be shaped, the rest of the row is written as usual */
+        shaped = shaped && shape.Get<Writer>(i++, key, &fragment, &length);
+        if (shaped) {
+            writer.RawValue(fragment, length, rapidjson::kStringType);
+        } else {
+            ok = pyobj2writer_key(key, writer);
+        }
+        ok = ok && pyobj2writer(value, writer, options);
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+    Py_END_CRITICAL_SECTION();
+    if (ok) {
+        writer.EndObject();
+    }
+    STATS_ENCODE_LEAVE();
+    Py_LeaveRecursiveCall();
+    return ok;
+}
+
+/* module.name from sys.modules, or NULL (and no error) if not there */
+static PyObject *
+imported_attr(PyObject *modules, const char *module, const char *name)
+{
+    PyObject *mod = PyDict_GetItemString(modules, module);
+    PyObject *attr;
+
+    if (mod == NULL || mod == Py_None) {
+        return NULL;
+    }
+    if ((attr = PyObject_GetAttrString(mod, name)) == NULL) {
+        PyErr_Clear();
+    }
+    return attr;
+}
+
+static void
+load_encode_types(const EncodeOptions& options)
+{
+    PyObject *modules = PyImport_GetModuleDict();
+
+    /* only the object layouts of datetime.h are used, not its C API */
+    (void)PyDateTimeAPI;
+    options.types_loaded = true;
+    options.datetime_type = imported_attr(modules, "datetime", "datetime");
+    options.date_type = imported_attr(modules, "datetime", "date");
+    options.time_type = imported_attr(modules, "datetime", "time");
+    options.timedelta_type = imported_attr(modules, "datetime", "timedelta");
+    options.uuid_type = imported_attr(modules, "uuid", "UUID");
+    options.decimal_type = imported_attr(modules, "decimal", "Decimal");
+    options.enum_type = imported_attr(modules, "enum", "Enum");
+    options.dataclass_field = imported_attr(modules, "dataclasses", "_FIELD");
+}
+
+static inline bool
+is_instance(PyObject *object, PyObject *type)
+{
+    return type != NULL && PyType_Check(type) &&
+           PyObject_TypeCheck(object, (PyTypeObject *)type);
+}
+
+static char *
+put_digits(char *p, int value, int width)
+{
+    for (int i = width - 1; i >= 0; i--) {
+        p[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    return p + width;
+}
+
+static char *
+put_date(char *p, PyObject *date)
+{
+    p = put_digits(p, PyDateTime_GET_YEAR(date), 4);
+    *p++ = '-';
+    p = put_digits(p, PyDateTime_GET_MONTH(date), 2);
+    *p++ = '-';
+    return put_digits(p, PyDateTime_GET_DAY(date), 2);
+}
+
+static char *
+put_time(char *p, int hour, int minute, int second, int microsecond)
+{
+    p = put_digits(p, hour, 2);
+    *p++ = ':';
+    p = put_digits(p, minute, 2);
+    *p++ = ':';
+    p = put_digits(p, second, 2);
+    if (microsecond) {
+        *p++ = '.';
+        p = put_digits(p, microsecond, 6);
+    }
+    return p;
+}
+
+/*
+ * tzinfo.utcoffset(arg) as isoformat() appends it, +HH:MM[:SS[.ffffff]],
+ * or nothing for None.
+ */
+static char *
+put_utcoffset(char *p, PyObject *tzinfo, PyObject *arg, const EncodeOptions& options)
+{
+    PyObject *offset = PyObject_CallMethod(tzinfo, (char *)"utcoffset", (char *)"O", arg);
+    PY_LONG_LONG total;
+    int seconds, microseconds;
+
+    if (offset == NULL) {
+        return NULL;
+    }
+    if (offset == Py_None) {
+        Py_DECREF(offset);
+        return p;
+    }
+    if (!is_instance(offset, options.timedelta_type)) {
+        Py_DECREF(offset);
+        PyErr_SetString(PyExc_TypeError, "utcoffset() must return None or timedelta");
+        return NULL;
+    }
+    total = ((PY_LONG_LONG)((PyDateTime_Delta *)offset)->days * 86400 +
+             ((PyDateTime_Delta *)offset)->seconds) * 1000000 +
+            ((PyDateTime_Delta *)offset)->microseconds;
+    Py_DECREF(offset);
+
+    *p++ = total < 0 ? '-' : '+';
+    if (total < 0) {
+        total = -total;
+    }
+    microseconds = (int)(total % 1000000);
+    total /= 1000000;
+    seconds = (int)(total % 60);
+    p = put_digits(p, (int)(total / 3600) % 100, 2);
+    *p++ = ':';
+    p = put_digits(p, (int)(total / 60 % 60), 2);
+    if (seconds || microseconds) {
+        *p++ = ':';
+        p = put_digits(p, seconds, 2);
+    }
+    if (microseconds) {
+        *p++ = '.';
+        p = put_digits(p, microseconds, 6);
+    }
+    return p;
+}
+
+/* datetime, date and time in ISO 8601, exactly as their isoformat() */
+template <typename Writer>
+static bool
+pyobj2writer_datetime(PyObject *object, Writer& writer, const EncodeOptions& options)
+{
+    char buffer[64];
+    char *p = buffer;
+
+    if (is_instance(object, options.datetime_type)) {
+        p = put_date(p, object);
+        *p++ = 'T';
+        p = put_time(p, PyDateTime_DATE_GET_HOUR(object), PyDateTime_DATE_GET_MINUTE(object),
+                     PyDateTime_DATE_GET_SECOND(object),
+                     PyDateTime_DATE_GET_MICROSECOND(object));
+        if (((PyDateTime_DateTime *)object)->hastzinfo) {
+            p = put_utcoffset(p, ((PyDateTime_DateTime *)object)->tzinfo, object, options);
+        }
+    } else if (is_instance(object, options.date_type)) {
+        p = put_date(p, object);
+    } else {
+        p = put_time(p, PyDateTime_TIME_GET_HOUR(object), PyDateTime_TIME_GET_MINUTE(object),
+                     PyDateTime_TIME_GET_SECOND(object),
+                     PyDateTime_TIME_GET_MICROSECOND(object));
+        if (((PyDateTime_Time *)object)->hastzinfo) {
+            p = put_utcoffset(p, ((PyDateTime_Time *)object)->tzinfo, Py_None, options);
+        }
+    }
+    if (p == NULL) {
+        return false;
+    }
+    return write_string(writer, buffer, p - buffer);
+}
+
+/* a UUID as str() writes it, from its 128-bit int attribute */
+template <typename Writer>
+static bool
+pyobj2writer_uuid(PyObject *object, Writer& writer)
+{
+    static const char hex[] = "0123456789abcdef";
+    PyObject *value, *high, *shift;
+    unsigned PY_LONG_LONG halves[2];
+    char buffer[36];
+    int i, n = 0;
+
+    if ((value = PyObject_GetAttrString(object, "int")) == NULL) {
+        return false;
+    }
+    halves[1] = PyLong_AsUnsignedLongLongMask(value);
+    shift = PyLong_FromLong(64);
+    high = shift ? PyNumber_Rshift(value, shift) : NULL;
+    Py_XDECREF(shift);
+    Py_DECREF(value);
+    if (high == NULL) {
+        return false;
+    }
+    halves[0] = PyLong_AsUnsignedLongLongMask(high);
+    Py_DECREF(high);
+    if (PyErr_Occurred()) {
+        return false;
+    }
+
+    for (i = 0; i < 32; i++) {
+        if (i == 8 || i == 12 || i == 16 || i == 20) {
+            buffer[n++] = '-';
+        }
+        buffer[n++] = hex[(halves[i / 16] >> (60 - 4 * (i % 16))) & 0xF];
+    }
+    return write_string(writer, buffer, n);
+}
+
+/* a Decimal as the number of its str(), which keeps every digit */
+template <typename Writer>
+static bool
+pyobj2writer_decimal(PyObject *object, Writer& writer)
+{
+    PyObject *str = PyObject_Str(object);
+    const char *text;
+    Py_ssize_t length;
+    bool ok = false;
+
+    if (str == NULL) {
+        return false;
+    }
+#ifdef PY3
+    text = unicode2utf8(str, &length);
+#else
+    text = PyString_AsString(str);
+    length = PyString_Size(str);
+#endif
+    if (text != NULL) {
+        /* NaN, sNaN and Infinity have no JSON form */
+        if (length > (text[0] == '-') && text[text[0] == '-'] >= '0' &&
+            text[text[0] == '-'] <= '9') {
+            writer.RawValue(text, (size_t)length, rapidjson::kNumberType);
+            ok = true;
+        } else {
+            PyErr_SetString(PyExc_ValueError,
+                            "Out of range decimal values are not JSON compliant");
+        }
+    }
+    Py_DECREF(str);
+    return ok;
+}
+
+/*
+ * The fields of a namedtuple as a dict, or NULL without an error for a
+ * tuple subclass whose _fields is missing or does not match its length.
+ */
+static PyObject *
+namedtuple2dict(PyObject *object)
+{
+    PyObject *fields, *dict;
+    Py_ssize_t i;
+
+    if ((fields = PyObject_GetAttrString((PyObject *)Py_TYPE(object), "_fields")) == NULL) {
+        PyErr_Clear();
+        return NULL;
+    }
+    if (!PyTuple_Check(fields) || PyTuple_GET_SIZE(fields) != PyTuple_GET_SIZE(object)) {
+        Py_DECREF(fields);
+        return NULL;
+    }
+    if ((dict = PyDict_New()) == NULL) {
+        Py_DECREF(fields);
+        return NULL;
+    }
+    for (i = 0; i < PyTuple_GET_SIZE(fields); i++) {
+        if (PyDict_SetItem(dict, PyTuple_GET_ITEM(fields, i),
+                           PyTuple_GET_ITEM(object, i)) < 0) {
+            Py_CLEAR(dict);
+            break;
+        }
+    }
+    Py_DECREF(fields);
+    return dict;
+}
+
+/*
+ * The fields of a dataclass as a dict, or NULL without an error for any
+ * other object.
+ */
+static PyObject *
+dataclass2dict(PyObject *object, const EncodeOptions& options)
+{
+    PyObject *type = (PyObject *)Py_TYPE(object);
+    PyObject *fields, *dict, *name, *field, *value;
+    Py_ssize_t pos = 0;
+
+    if ((fields = PyObject_GetAttrString(type, "__dataclass_fields__")) == NULL) {
+        PyErr_Clear();
+        return NULL;
+    }
+    if (!PyDict_Check(fields) || (dict = PyDict_New()) == NULL) {
+        Py_DECREF(fields);
+        return NULL;
+    }
+    while (PyDict_Next(fields, &pos, &name, &field)) {
+        /* ClassVar and InitVar pseudo-fields are no part of the instance */
+        if (options.dataclass_field != NULL) {
+            PyObject *field_type = PyObject_GetAttrString(field, "_field_type");
+            Py_XDECREF(field_type);
+            if (field_type == NULL) {
+                PyErr_Clear();
+            } else if (field_type != options.dataclass_field) {
+                continue;
+            }
+        }
+        if ((value = PyObject_GetAttr(object, name)) == NULL ||
+            PyDict_SetItem(dict, name, value) < 0) {
+            Py_XDECREF(value);
+            Py_CLEAR(dict);
+            break;
+        }
+        Py_DECREF(value);
+    }
+    Py_DECREF(fields);
+    return dict;
+}
+
+/*
+ * Objects of none of the JSON types: datetime, date, time, UUID, Decimal,
+ * Enum (as its value), dataclasses (as objects of their fields), then
+ * whatever default= makes of the rest.
+ */
+template <typename Writer>
+static bool
+pyobj2writer_other(PyObject *object, Writer& writer, const EncodeOptions& options)
+{
+    PyObject *value;
+    bool ok;
+
+    if (!options.types_loaded) {
+        load_encode_types(options);
+    }
+
+    if (is_instance(object, options.date_type) || is_instance(object, options.time_type)) {
+        return pyobj2writer_datetime(object, writer, options);
+    }
+    if (is_instance(object, options.uuid_type)) {
+        return pyobj2writer_uuid(object, writer);
+    }
+    if (is_instance(object, options.decimal_type)) {
+        return pyobj2writer_decimal(object, writer);
+    }
+
+    if (is_instance(object, options.enum_type)) {
+        value = PyObject_GetAttrString(object, "_value_");
+    } else if ((value = dataclass2dict(object, options)) == NULL && !PyErr_Occurred()) {
+        if (options.default_ == NULL) {
+            PyErr_SetString(PyExc_RuntimeError, "invalid python object");
+            return false;
+        }
+        value = PyObject_CallFunctionObjArgs(options.default_, object, NULL);
+    }
+    if (value == NULL) {
+        return false;
+    }
+    /* a default= returning its argument would never end */
+    if (Py_EnterRecursiveCall(" while encoding a JSON value")) {
+        Py_DECREF(value);
+        return false;
+    }
+    ok = pyobj2writer(value, writer, options);
+    Py_LeaveRecursiveCall();
+    Py_DECREF(value);
+    return ok;
+}
+
+/*
+ * The members of a dict, ordered by key. The items are taken out of the
+ * dict first: their keys are converted before anything is written.
+ * Keys that are equal as text (1 and "1") keep their dict order.
+ */
+template <typename Writer>
+static bool
+pyobj2writer_sorted(PyObject *dict, Writer& writer, const EncodeOptions& options)
+{
+    std::vector<PyObject *> items;  /* key, value, key, value, ... held */
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    size_t i, count;
+    bool ok = true;
+
+    Py_BEGIN_CRITICAL_SECTION(dict);
+    items.reserve(2 * (size_t)PyDict_Size(dict));
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        Py_INCREF(key);
+        Py_INCREF(value);
+        items.push_back(key);
+        items.push_back(value);
+    }
+    Py_END_CRITICAL_SECTION();
+
+    count = items.size() / 2;
+    KeyText *keys = new KeyText[count];
+    std::vector<size_t> order(count);
+    for (i = 0; ok && i < count; i++) {
+        ok = keys[i].Get(items[2 * i]);
+        order[i] = i;
+    }
+    if (ok) {
+        std::stable_sort(order.begin(), order.end(), KeyTextLess(keys));
+    }
+    for (i = 0; ok && i < count; i++) {
+        const KeyText& text = keys[order[i]];
+        ok = write_string(writer, text.data, text.length, true) &&
+             pyobj2writer(items[2 * order[i] + 1], writer, options);
+    }
+
+    delete[] keys;
+    for (i = 0; i < items.size(); i++) {
+        Py_DECREF(items[i]);
+    }
+    return ok;
+}
+
+/*
+ * Encode a Python object by calling the Writer's SAX-style events
+ * directly, without building an intermediate rapidjson::Document.
+ *
+ * Lists and dicts are walked inside their critical section, so another
+ * thread of a free-threaded build cannot resize them underneath, and each
+ * item is held while it is written: a key's __str__ (or that other thread,
+ * while a nested container suspends the section) may drop it from the
+ * container.
+ */
+template <typename Writer>
+static bool
+pyobj2writer(PyObject *object, Writer& writer, const EncodeOptions& options)
+{
+    if (PyBool_Check(object)) {
+        writer.Bool(Py_True == object);
+    }
+    else if (Py_None == object) {
+        writer.Null();
+    }
+    else if (PyFloat_Check(object)) {
+        double d = PyFloat_AS_DOUBLE(object);
+
+        /* |d| < 2**53: every such integer converts exactly */
+        if (options.canonical && d == floor(d) && fabs(d) < 9007199254740992.0) {
+            writer.Int64((int64_t)d);
+        }
+        else if (!writer.Double(d)) {
+            PyErr_SetString(PyExc_ValueError,
+                            "Out of range float values are not JSON compliant");
+            return false;
+        }
+    }
+#ifndef PY3
+    else if (PyInt_Check(object)) {
+        writer.Int64(PyInt_AS_LONG(object));
+    }
+#endif
+    else if (PyLong_Check(object)) {
+        if (!pyobj2writer_long(object, writer)) {
+            return false;
+        }
+    }
+    else if (PyString_Check(object)) {
+        if (!write_string(writer, PyString_AsString(object), PyString_Size(object))) {
+            return false;
+        }
+    }
+    else if (PyUnicode_Check(object)) {
+#ifdef PY3
+        Py_ssize_t length;
+        const char *str = unicode2utf8(object, &length);
+        if (!str || !write_string(writer, str, length)) {
+            return false;
+        }
+#else
+        PyObject *utf8_item = PyUnicode_AsUTF8String(object);
+        if (!utf8_item) {
+            return false;
+        }
+        bool ok = write_string(writer, PyString_AS_STRING(utf8_item),
+                               PyString_GET_SIZE(utf8_item));
+        Py_DECREF(utf8_item);
+        if (!ok) {
+            return false;
+        }
+#endif
+    }
+    else if (PyList_Check(object) || PyTuple_Check(object)) {
+        PyObject *seq = object;
+        PyObject *item;
+        KeyShape shape;
+        Py_ssize_t i;
+        bool ok = true;
+
+        if (options.namedtuple_as_object && PyTuple_Check(object) && !PyTuple_CheckExact(object)) {
+            PyObject *dict = namedtuple2dict(object);
+
+            if (dict != NULL) {
+                ok = pyobj2writer(dict, writer, options);
+                Py_DECREF(dict);
+                return ok;
+            }
+            if (PyErr_Occurred()) {
+                return false;
+            }
+        }
+        if (Py_EnterRecursiveCall(" while encoding a JSON array")) {
+            return false;
+        }
+        STATS_ENCODE_ENTER();
+        writer.StartArray();
+        Py_BEGIN_CRITICAL_SECTION(seq);
+        for (i = 0; ok && i < PySequence_Fast_GET_SIZE(seq); ++i) {
+            item = PySequence_Fast_GET_ITEM(seq, i);
+            Py_INCREF(item);
+            if (PyDict_Check(item) && PySequence_Fast_GET_SIZE(seq) > 1) {
+                ok = pyobj2writer_row(item, writer, shape, options);
+            } else {
+                ok = pyobj2writer(item, writer, options);
+            }
+            Py_DECREF(item);
+        }
+        Py_END_CRITICAL_SECTION();
+        STATS_ENCODE_LEAVE();
+        Py_LeaveRecursiveCall();
+        if (!ok) {
+            return false;
+        }
+        writer.EndArray();
+    }
+    else if (PyDict_Check(object)) {
+        PyObject *key, *value;
+        Py_ssize_t pos = 0;
+        bool ok = true;
+
+        if (Py_EnterRecursiveCall(" while encoding a JSON object")) {
+            return false;
+        }
+        STATS_ENCODE_ENTER();
+        writer.StartObject();
+        if (options.sort_keys) {
+            ok = pyobj2writer_sorted(object, writer, options);
+        } else {
+            Py_BEGIN_CRITICAL_SECTION(object);
+            while (ok && PyDict_Next(object, &pos, &key, &value)) {
+                Py_INCREF(key);
+                Py_INCREF(value);
+                ok = pyobj2writer_key(key, writer) && pyobj2writer(value, writer, options);
+                Py_DECREF(key);
+                Py_DECREF(value);
+            }
+            Py_END_CRITICAL_SECTION();
+        }
+        STATS_ENCODE_LEAVE();
+        Py_LeaveRecursiveCall();
+        if (!ok) {
+            return false;
+        }
+        writer.EndObject();
+    }
+    else {
+        return pyobj2writer_other(object, writer, options);
+    }
+
+    return true;
+}
+
+/*
+ * TargetEncoding is ASCII<> for ensure_ascii (non-ASCII characters escaped
+ * as \uXXXX) and UTF8<> to emit them as they are.
+ */
+template <typename TargetEncoding>
+static PyObject *
+pyobj2pystring(PyObject *pyjson, const EncodeOptions& options)
+{
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, TargetEncoding> writer(buffer);
+
+    STATS_START(timer);
+    bool ok = pyobj2writer(pyjson, writer, options);
+    STATS_STOP(encode_ns, timer);
+    STATS_ADD(encode_calls, 1);
+    STATS_ADD(bytes_out, buffer.GetSize());
+    if (!ok) {
+        return NULL;
+    }
+
+    return PyString_FromStringAndSize(buffer.GetString(), buffer.GetSize());
+}
+
+/*
+ * Input stream for rapidjson::Reader that pulls the text from a file
+ * object chunk by chunk with fp.read(chunk_size), in the manner of
+ * rapidjson::FileReadStream. Only the current chunk is kept alive.
+ */
+class PyFileReadStream {
+public:
+    typedef char Ch;
+
+    PyFileReadStream(PyObject *read_method, Py_ssize_t chunk_size)
+        : read_method_(read_method), chunk_size_(chunk_size), chunk_(NULL),
+          current_(""), last_(current_), count_(0), eof_(false),
+          failed_(false) {
+        Py_INCREF(read_method_);
+    }
+
+    ~PyFileReadStream() {
+        Py_XDECREF(chunk_);
+        Py_DECREF(read_method_);
+    }
+
+    /*
+     * The next chunk is only read once a character past the current one is
+     * asked for, so a value ending on a chunk boundary is complete (and
+     * iterload() hands it out) without waiting for more input.
+     */
+    Ch Peek() {
+        if (current_ == last_ && !eof_ && !failed_) {
+            Read();
+        }
+        return *current_;
+    }
+
+    Ch Take() {
+        Ch c = Peek();
+        if (current_ < last_) {
+            ++current_;
+        }
+        return c;
+    }
+
+    size_t Tell() const {
+        return count_ - (size_t)(last_ - current_);
+    }
+
+    bool Failed() const {
+        return failed_;
+    }
+
+    /* for the GC, when a Python object keeps the stream */
+    int Traverse(visitproc visit, void *arg) {
+        Py_VISIT(read_method_);
+        return 0;
+    }
+
+    // Not implemented
+    void Put(Ch) { RAPIDJSON_ASSERT(false); }
+    void Flush() { RAPIDJSON_ASSERT(false); }
+    Ch* PutBegin() { RAPIDJSON_ASSERT(false); return 0; }
+    size_t PutEnd(Ch*) { RAPIDJSON_ASSERT(false); return 0; }
+
+private:
+    /* fetch the next non-empty chunk; at the end, current_ points at "" */
+    void Read() {
+        while (!eof_) {
+            const char *data;
+            Py_ssize_t length;
+            PyObject *chunk;
+
+            chunk = PyObject_CallFunction(read_method_, (char *)"n", chunk_size_);
+            if (chunk == NULL) {
+                failed_ = true;
+                break;
+            }
+#ifdef PY3
+            if (PyUnicode_Check(chunk)) {
+                data = PyUnicode_AsUTF8AndSize(chunk, &length);
+            }
+#else
+            if (PyUnicode_Check(chunk)) {
+                PyObject *utf8_item = PyUnicode_AsUTF8String(chunk);
+                Py_DECREF(chunk);
+                chunk = utf8_item;
+                data = chunk ? PyString_AS_STRING(chunk) : NULL;
+                length = chunk ? PyString_GET_SIZE(chunk) : 0;
+            }
+#endif
+            else if (PyBytes_Check(chunk)) {
+                data = PyBytes_AS_STRING(chunk);
+                length = PyBytes_GET_SIZE(chunk);
+            }
             else {
-                pyjson = PyInt_FromString(text, NULL, 10);
+                PyErr_Format(PyExc_TypeError,
+                             "read() should return str or bytes, not %.200s",
+                             Py_TYPE(chunk)->tp_name);
+                data = NULL;
+            }
+            if (data == NULL) {
+                Py_XDECREF(chunk);
+                failed_ = true;
+                break;
+            }
+
+            Py_XDECREF(chunk_);
+            chunk_ = chunk;
+            if (length == 0) {
+                break;
+            }
+            current_ = data;
+            last_ = data + length;
+            count_ += (size_t)length;
+            return;
+        }
+        eof_ = true;
+        Py_CLEAR(chunk_);
+        current_ = last_ = "";
+    }
+
+    PyObject *read_method_;
+    Py_ssize_t chunk_size_;
+    PyObject *chunk_;
+    const char *current_;
+    const char *last_;
+    size_t count_;
+    bool eof_;
+    bool failed_;
+};
+
+/* fp.read as a new reference, or NULL with TypeError */
+static PyObject *
+get_read_method(PyObject *py_file)
+{
+    PyObject *read_method;
+
+    if (!PyObject_HasAttrString(py_file, "read")) {
+        PyErr_Format(PyExc_TypeError, "expected file object. has not read() method.");
+        return NULL;
+    }
+    read_method = PyObject_GetAttrString(py_file, "read");
+    if (!PyCallable_Check(read_method)) {
+        Py_XDECREF(read_method);
+        PyErr_Format(PyExc_TypeError, "expected file object. read() method is not callable.");
+        return NULL;
+    }
+    return read_method;
+}
+
+/*
+ * Objects that keep parser or writer state between calls (Decoder, Encoder,
+ * the iterators) run one call at a time: a second call, from a callback
+ * such as a key's __str__ or fp.read(), or from another thread while the
+ * first has released the GIL or in a free-threaded build, is refused.
+ */
+static inline bool
+busy_enter(PyObject *owner, bool *busy)
+{
+    bool claimed;
+
+    Py_BEGIN_CRITICAL_SECTION(owner);
+    claimed = !*busy;
+    *busy = true;
+    Py_END_CRITICAL_SECTION();
+    return claimed;
+}
+
+static inline void
+busy_leave(PyObject *owner, bool *busy)
+{
+    Py_BEGIN_CRITICAL_SECTION(owner);
+    *busy = false;
+    Py_END_CRITICAL_SECTION();
+}
+
+/* iterator returned by iterload() */
+typedef struct {
+    PyObject_HEAD
+    PyFileReadStream *stream;       /* NULL once cleared by the GC */
+    bool cache_values;
+    bool done;
+    bool busy;
+} IterLoaderObject;
+
+static PyTypeObject IterLoaderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "rapidjson.IterLoader",         /* tp_name */
+    sizeof(IterLoaderObject),       /* tp_basicsize */
+};
+
+static int
+IterLoader_traverse(IterLoaderObject *self, visitproc visit, void *arg)
+{
+    return self->stream ? self->stream->Traverse(visit, arg) : 0;
+}
+
+static int
+IterLoader_clear(IterLoaderObject *self)
+{
+    delete self->stream;
+    self->stream = NULL;
+    self->done = true;
+    return 0;
+}
+
+static void
+IterLoader_dealloc(IterLoaderObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    IterLoader_clear(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject *
+IterLoader_iternext(IterLoaderObject *self)
+{
+    PyObject *ret = NULL;
+    char c;
+
+    /* fp.read() could call back into this */
+    if (!busy_enter((PyObject *)self, &self->busy)) {
+        PyErr_SetString(PyExc_RuntimeError, "iterload is already in use");
+        return NULL;
+    }
+    if (self->done) {
+        busy_leave((PyObject *)self, &self->busy);
+        return NULL;
+    }
+
+    PyFileReadStream& is = *self->stream;
+    /* skip the whitespace separating top-level values */
+    while ((c = is.Peek()) == ' ' || c == '\n' || c == '\r' || c == '\t') {
+        is.Take();
+    }
+    if (c == '\0') {
+        self->done = true;
+    } else {
+        PyObjectHandler handler(self->cache_values);
+        ret = stream2pyobj<rapidjson::kParseStopWhenDoneFlag>(is, handler);
+        if (ret == NULL || is.Failed()) {
+            self->done = true;
+            Py_CLEAR(ret);
+        }
+    }
+    busy_leave((PyObject *)self, &self->busy);
+    return ret;
+}
+
+/*
+ * Output stream for rapidjson::Writer that fills a fixed-size buffer and
+ * hands it to the file object each time it fills up: straight to the
+ * descriptor for raw files, through fp.write() otherwise.
+ */
+class PyFileWriteStream {
+public:
+    typedef char Ch;
+
+    PyFileWriteStream(PyObject *write_method, int fd, bool binary,
+                      size_t chunk_size)
+        : write_method_(write_method), fd_(fd), binary_(binary),
+          buffer_(chunk_size < 4 ? 4 : chunk_size), length_(0),
+          written_(0), failed_(false) {}
+
+    void Put(Ch c) {
+        if (length_ == buffer_.size()) {
+            Write(false);
+        }
+        buffer_[length_++] = c;
+    }
+
+    void Flush() {
+        Write(true);
+    }
+
+    bool Failed() const {
+        return failed_;
+    }
+
+    /* number of bytes put so far */
+    size_t Tell() const {
+        return written_ + length_;
+    }
+
+private:
+    /* length of the longest prefix of the buffer not splitting a UTF-8 char */
+    size_t CompleteLength() const {
+        size_t i = length_;
+        while (i > 0 && length_ - i < 4) {
+            unsigned char c = (unsigned char)buffer_[i - 1];
+            if ((c & 0xC0) != 0x80) {
+                size_t need = c < 0x80 ? 1 : c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+                return (length_ - (i - 1) >= need) ? length_ : i - 1;
+            }
+            --i;
+        }
+        return length_;
+    }
+
+    void WriteFd(const char *data, size_t length) {
+        int err = 0;
+
+        Py_BEGIN_ALLOW_THREADS
+        while (length > 0) {
+#ifdef _WIN32
+            int n = _write(fd_, data, (unsigned int)length);
+#else
+            ssize_t n = write(fd_, data, length);
+#endif
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                err = errno;
+                break;
+            }
+            data += n;
+            length -= (size_t)n;
+        }
+        Py_END_ALLOW_THREADS
+
+        if (err) {
+            errno = err;
+            PyErr_SetFromErrno(PyExc_OSError);
+            failed_ = true;
+        }
+    }
+
+    void WriteMethod(const char *data, size_t length) {
+        PyObject *chunk, *write_ret;
+
+        if (binary_) {
+            chunk = PyBytes_FromStringAndSize(data, length);
+        } else {
+#ifdef PY3
+            chunk = PyUnicode_DecodeUTF8(data, length, NULL);
+#else
+            chunk = PyString_FromStringAndSize(data, length);
+#endif
+        }
+        if (chunk == NULL) {
+            failed_ = true;
+            return;
+        }
+        write_ret = PyObject_CallFunctionObjArgs(write_method_, chunk, NULL);
+        Py_DECREF(chunk);
+        if (write_ret == NULL) {
+            failed_ = true;
+            return;
+        }
+        Py_DECREF(write_ret);
+    }
+
+    void Write(bool all) {
+        size_t length = length_;
+
+        if (failed_ || length == 0) {
+            length_ = 0;
+            return;
+        }
+        if (fd_ >= 0) {
+            WriteFd(&buffer_[0], length);
+        } else {
+            if (!all && !binary_) {
+                length = CompleteLength();
+            }
+            WriteMethod(&buffer_[0], length);
+        }
+        /* keep a split UTF-8 sequence for the next chunk */
+        memmove(&buffer_[0], &buffer_[length], length_ - length);
+        length_ -= length;
+        written_ += length;
+    }
+
+    PyObject *write_method_;
+    int fd_;
+    bool binary_;
+    std::vector<char> buffer_;
+    size_t length_;
+    size_t written_;
+    bool failed_;
+};
+
+/*
+ * Per-module state. Each interpreter importing the module gets a module
+ * object of its own (multi-phase init), and with it its own references to
+ * the objects of other modules.
+ */
+typedef struct {
+    PyObject *io_FileIO;
+    PyObject *io_binary_types;
+    /* imported by fingerprint() on first use */
+    PyObject *hashlib;
+    PyObject *xxhash;
+} ModuleState;
+
+#ifdef PY3
+#define get_module_state(module) ((ModuleState *)PyModule_GetState(module))
+#else
+static ModuleState module_state;
+#define get_module_state(module) (&module_state)
+#endif
+
+static bool
+load_io_types(ModuleState *state)
+{
+    PyObject *io;
+
+    io = PyImport_ImportModule("io");
+    if (io == NULL) {
+        return false;
+    }
+    state->io_FileIO = PyObject_GetAttrString(io, "FileIO");
+    state->io_binary_types = Py_BuildValue("(NN)",
+                                           PyObject_GetAttrString(io, "RawIOBase"),
+                                           PyObject_GetAttrString(io, "BufferedIOBase"));
+    Py_DECREF(io);
+    if (state->io_FileIO == NULL || state->io_binary_types == NULL) {
+        Py_CLEAR(state->io_FileIO);
+        Py_CLEAR(state->io_binary_types);
+        return false;
+    }
+    return true;
+}
+
+/* whether fp.write() expects bytes rather than str */
+static int
+is_binary_file(ModuleState *state, PyObject *py_file)
+{
+#ifdef PY3
+    PyObject *mode;
+    int ret = PyObject_IsInstance(py_file, state->io_binary_types);
+
+    if (ret != 0) {
+        return ret;
+    }
+    mode = PyObject_GetAttrString(py_file, "mode");
+    if (mode == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+    ret = PyUnicode_Check(mode) && PyUnicode_FindChar(
+        mode, 'b', 0, PyUnicode_GET_LENGTH(mode), 1) >= 0;
+    Py_DECREF(mode);
+    return ret;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * fp's descriptor when it is exactly a raw io.FileIO (subclasses may
+ * override write()) open for writing, -1 when it is not, -2 on error.
+ * A read-only file goes through fp.write(), which raises
+ * io.UnsupportedOperation.
+ */
+static int
+raw_file_descriptor(ModuleState *state, PyObject *py_file)
+{
+    PyObject *py_fd, *writable;
+    int fd, ok;
+
+    if ((PyObject *)Py_TYPE(py_file) != state->io_FileIO) {
+        return -1;
+    }
+
+    writable = PyObject_CallMethod(py_file, (char *)"writable", NULL);
+    if (writable == NULL) {
+        return -2;
+    }
+    ok = PyObject_IsTrue(writable);
+    Py_DECREF(writable);
+    if (ok <= 0) {
+        return ok < 0 ? -2 : -1;
+    }
+
+    py_fd = PyObject_CallMethod(py_file, (char *)"fileno", NULL);
+    if (py_fd == NULL) {
+        return -2;
+    }
+    fd = (int)PyLong_AsLong(py_fd);
+    Py_DECREF(py_fd);
+    if (fd == -1 && PyErr_Occurred()) {
+        return -2;
+    }
+    if (!_PyVerify_fd(fd)) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -2;
+    }
+    return fd;
+}
+
+/*
+ * rapidjson.Schema: a JSON Schema compiled once into a
+ * rapidjson::SchemaDocument, which is immutable afterwards and so can be
+ * shared by any number of loads() and validate() calls.
+ */
+typedef struct {
+    PyObject_HEAD
+    rapidjson::SchemaDocument *schema;
+} SchemaObject;
+
+PyDoc_STRVAR(Schema__doc__,
+             "Schema(schema) -> compiled JSON Schema, given as JSON text or as Python objects\n\n"
+             "Pass it to loads(text, schema=...) to validate while decoding");
+PyDoc_STRVAR(ValidationError__doc__,
+             "Raised when a document does not match a Schema; keyword, schema_pointer\n"
+             "and document_pointer tell which rule failed where");
+PyDoc_STRVAR(Schema_validate__doc__,
+             "S.validate(text) -> None; raises ValidationError if text does not match");
+
+static PyTypeObject SchemaType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "rapidjson.Schema",             /* tp_name */
+    sizeof(SchemaObject),           /* tp_basicsize */
+};
+
+static PyObject *
+Schema_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"schema", NULL};
+    PyObject *obj;
+    rapidjson::StringBuffer encoded;
+    rapidjson::Document doc;
+    TextBuffer buffer;
+    SchemaObject *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O:Schema", kwlist, &obj))
+        return NULL;
+
+    if (PyUnicode_Check(obj) || PyObject_CheckBuffer(obj)) {
+        if (!buffer.Get(obj)) {
+            return NULL;
+        }
+    } else {
+        /* dicts and the like go through the encoder first */
+        rapidjson::Writer<rapidjson::StringBuffer> writer(encoded);
+        EncodeOptions options;
+
+        if (!pyobj2writer(obj, writer, options)) {
+            return NULL;
+        }
+        buffer.data = encoded.GetString();
+        buffer.length = (Py_ssize_t)encoded.GetSize();
+    }
+
+    if (!buffer2doc<rapidjson::kParseDefaultFlags>(
+            doc, buffer.data, (size_t)buffer.length, false)) {
+        return NULL;
+    }
+    if (!doc.IsObject()) {
+        PyErr_SetString(PyExc_ValueError, "schema must be a JSON object");
+        return NULL;
+    }
+
+    self = (SchemaObject *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->schema = new rapidjson::SchemaDocument(doc);
+
+    return (PyObject *)self;
+}
+
+static void
+Schema_dealloc(SchemaObject *self)
+{
+    delete self->schema;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/*
+ * Only validates: the events go to a handler that drops them, so no Python
+ * object is built and the GIL can be released for large texts.
+ */
+static PyObject *
+Schema_validate(SchemaObject *self, PyObject *text)
+{
+    rapidjson::SchemaValidator validator(*self->schema);
+    rapidjson::Reader reader;
+    TextBuffer buffer;
+    SchemaFailure failure;
+
+    if (!buffer.Get(text)) {
+        return NULL;
+    }
+
+    rapidjson::MemoryStream is(buffer.data, (size_t)buffer.length);
+    if (use_nogil(NULL, (size_t)buffer.length)) {
+        Py_BEGIN_ALLOW_THREADS
+        reader.Parse<rapidjson::kParseDefaultFlags>(is, validator);
+        Py_END_ALLOW_THREADS
+    } else {
+        reader.Parse<rapidjson::kParseDefaultFlags>(is, validator);
+    }
+
+    if (!validator.IsValid() && failure.Record(validator)) {
+        raise_validation_error(failure);
+        return NULL;
+    }
+    if (reader.HasParseError()) {
+        PyErr_SetString(PyExc_ValueError,
+                        GetParseError_En(reader.GetParseErrorCode()));
+        return NULL;
+    }
+    if (!check_consumed(is, (size_t)buffer.length)) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef Schema_methods[] = {
+    {"validate", (PyCFunction)Schema_validate, METH_O, Schema_validate__doc__},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+/* the SchemaDocument of a schema= argument; false with TypeError set */
+static bool
+schema_arg(PyObject *obj, const rapidjson::SchemaDocument **schema)
+{
+    *schema = NULL;
+    if (obj == NULL || obj == Py_None) {
+        return true;
+    }
+    if (!PyObject_TypeCheck(obj, &SchemaType)) {
+        PyErr_Format(PyExc_TypeError,
+                     "schema must be a rapidjson.Schema, not %.200s",
+                     Py_TYPE(obj)->tp_name);
+        return false;
+    }
+    *schema = ((SchemaObject *)obj)->schema;
+    return true;
+}
+
+static PyObject *
+pyrapidjson_loads(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"text", (char *)"cache_values", (char *)"release_gil", (char *)"fields", (char *)"schema", NULL};
+    PyObject *text;
+    PyObject *cache_values = NULL;
+    PyObject *release_gil = NULL;
+    PyObject *fields = NULL;
+    PyObject *schema_obj = NULL;
+    const rapidjson::SchemaDocument *schema;
+    FieldSpec spec;
+    TextBuffer buffer;
+
+    /* Parse arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOOO", kwlist,
+                                     &text, &cache_values, &release_gil,
+                                     &fields, &schema_obj))
+        return NULL;
+
+    if (!schema_arg(schema_obj, &schema)) {
+        return NULL;
+    }
+    if (fields && fields != Py_None && !fields2spec(fields, spec)) {
+        return NULL;
+    }
+    if (!buffer.Get(text)) {
+        return NULL;
+    }
+
+    PyObjectHandler handler(cache_values && PyObject_IsTrue(cache_values),
+                            fields && fields != Py_None ? &spec : NULL);
+    return buffer2pyobj<rapidjson::kParseDefaultFlags>(
+        buffer.data, (size_t)buffer.length, handler,
+        use_nogil(release_gil, (size_t)buffer.length), NULL, NULL, schema);
+}
+
+static PyObject *
+pyrapidjson_load(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"text", (char *)"cache_values", (char *)"chunk_size", (char *)"fields", (char *)"schema", NULL};
+    PyObject *py_file, *read_method;
+    PyObject *cache_values = NULL;
+    PyObject *fields = NULL;
+    PyObject *schema_obj = NULL;
+    const rapidjson::SchemaDocument *schema;
+    Py_ssize_t chunk_size = LOAD_CHUNK_SIZE;
+    FieldSpec spec;
+
+    /* Parse arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OnOO", kwlist,
+                                     &py_file, &cache_values, &chunk_size,
+                                     &fields, &schema_obj))
+        return NULL;
+
+    if (chunk_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
+        return NULL;
+    }
+    if (!schema_arg(schema_obj, &schema)) {
+        return NULL;
+    }
+    if (fields && fields != Py_None && !fields2spec(fields, spec)) {
+        return NULL;
+    }
+
+    read_method = get_read_method(py_file);
+    if (read_method == NULL) {
+        return NULL;
+    }
+
+    PyObjectHandler handler(cache_values && PyObject_IsTrue(cache_values),
+                            fields && fields != Py_None ? &spec : NULL);
+    PyFileReadStream is(read_method, chunk_size);
+    Py_DECREF(read_method);
+
+    PyObject *ret = stream2pyobj<rapidjson::kParseDefaultFlags>(is, handler, schema);
+    if (ret != NULL && is.Failed()) {
+        Py_CLEAR(ret);
+    }
+    return ret;
+}
+
+
+static PyObject *
+pyrapidjson_iterload(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"fp", (char *)"cache_values", (char *)"chunk_size", NULL};
+    PyObject *py_file, *read_method;
+    PyObject *cache_values = NULL;
+    Py_ssize_t chunk_size = LOAD_CHUNK_SIZE;
+    IterLoaderObject *iter;
+
+    /* Parse arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|On", kwlist,
+                                     &py_file, &cache_values, &chunk_size))
+        return NULL;
+
+    if (chunk_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
+        return NULL;
+    }
+
+    read_method = get_read_method(py_file);
+    if (read_method == NULL) {
+        return NULL;
+    }
+
+    iter = PyObject_GC_New(IterLoaderObject, &IterLoaderType);
+    if (iter == NULL) {
+        Py_DECREF(read_method);
+        return NULL;
+    }
+    iter->cache_values = cache_values && PyObject_IsTrue(cache_values);
+    iter->done = false;
+    iter->busy = false;
+    iter->stream = new PyFileReadStream(read_method, chunk_size);
+    Py_DECREF(read_method);
+    PyObject_GC_Track(iter);
+    if (PyErr_Occurred()) {
+        Py_DECREF(iter);
+        return NULL;
+    }
+
+    return (PyObject *)iter;
+}
+
+
+#ifndef _WIN32
+/* read-only private mapping of a whole file, unmapped on destruction */
+class MappedFile {
+public:
+    const char *data;
+    size_t length;
+
+    MappedFile() : data(""), length(0), mapped_(false) {}
+
+    ~MappedFile() {
+        if (mapped_) {
+            munmap((void *)data, length);
+        }
+    }
+
+    /* returns false with errno set */
+    bool Open(const char *path, bool sequential) {
+        struct stat st;
+        void *addr;
+        int fd, err;
+
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        if (fstat(fd, &st) < 0) {
+            err = errno;
+            close(fd);
+            errno = err;
+            return false;
+        }
+        if (st.st_size == 0) {
+            close(fd);
+            return true;
+        }
+        addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        err = errno;
+        close(fd);
+        if (addr == MAP_FAILED) {
+            errno = err;
+            return false;
+        }
+#ifdef MADV_SEQUENTIAL
+        if (sequential) {
+            madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+        }
+#endif
+        data = (const char *)addr;
+        length = (size_t)st.st_size;
+        mapped_ = true;
+        return true;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    bool mapped_;
+};
+#endif
+
+static PyObject *
+pyrapidjson_load_path(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"path", (char *)"cache_values", (char *)"release_gil", (char *)"sequential", (char *)"fields", (char *)"schema", NULL};
+    PyObject *cache_values = NULL;
+    PyObject *release_gil = NULL;
+    PyObject *sequential = NULL;
+    PyObject *fields = NULL;
+    PyObject *schema_obj = NULL;
+    const rapidjson::SchemaDocument *schema;
+    PyObject *ret = NULL;
+    FieldSpec spec;
+    const char *path;
+#ifdef PY3
+    PyObject *path_bytes;
+
+    /* Parse arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|OOOOO", kwlist,
+                                     PyUnicode_FSConverter, &path_bytes,
+                                     &cache_values, &release_gil, &sequential,
+                                     &fields, &schema_obj))
+        return NULL;
+    path = PyBytes_AS_STRING(path_bytes);
+#else
+    /* Parse arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|OOOOO", kwlist, &path,
+                                     &cache_values, &release_gil, &sequential,
+                                     &fields, &schema_obj))
+        return NULL;
+#endif
+
+    if (!schema_arg(schema_obj, &schema) ||
+        (fields && fields != Py_None && !fields2spec(fields, spec))) {
+#ifdef PY3
+        Py_DECREF(path_bytes);
+#endif
+        return NULL;
+    }
+
+    PyObjectHandler handler(cache_values && PyObject_IsTrue(cache_values),
+                            fields && fields != Py_None ? &spec : NULL);
+
+#ifndef _WIN32
+    MappedFile file;
+    bool madvise_sequential = sequential == NULL || PyObject_IsTrue(sequential);
+    bool opened;
+
+    Py_BEGIN_ALLOW_THREADS
+    opened = file.Open(path, madvise_sequential);
+    Py_END_ALLOW_THREADS
+
+    if (!opened) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    } else {
+        ret = buffer2pyobj<rapidjson::kParseDefaultFlags>(
+            file.data, file.length, handler,
+            use_nogil(release_gil, file.length), NULL, NULL, schema);
+    }
+#else
+    /* no mmap here; stream the file through rapidjson::FileReadStream */
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    } else {
+        char read_buffer[LOAD_CHUNK_SIZE];
+        rapidjson::FileReadStream is(fp, read_buffer, sizeof(read_buffer));
+        ret = stream2pyobj<rapidjson::kParseDefaultFlags>(is, handler, schema);
+        fclose(fp);
+    }
+#endif
+
+#ifdef PY3
+    Py_DECREF(path_bytes);
+#endif
+    return ret;
+}
+
+
+/*
+ * loads_many(): the texts are parsed into rapidjson::Values by native
+ * threads, the caller's included, with the GIL released. Threads claim
+ * small batches of items from a shared counter until none are left, so a
+ * thread that draws large texts simply claims fewer batches. Each thread
+ * allocates its values from its own pool; the values are converted to
+ * Python objects in order once all threads are done.
+ */
+struct ManyItem {
+    const char *data;
+    size_t length;
+    bool parse;                         /* false when the item is no text */
+    rapidjson::ParseErrorCode code;
+};
+
+struct ManyJob {
+    ManyItem *items;
+    rapidjson::Value *values;
+    size_t count;
+    size_t batch;
+    size_t next;                        /* first unclaimed item, under `lock` */
+    int running;                        /* threads still parsing, under `lock` */
+    PyThread_type_lock lock;
+    PyThread_type_lock done;            /* held until the last thread is done */
+};
+
+struct ManyWorker {
+    ManyJob *job;
+    rapidjson::Document::AllocatorType *pool;
+};
+
+#ifndef PYTHREAD_INVALID_THREAD_ID
+#define PYTHREAD_INVALID_THREAD_ID (-1)
+#endif
+
+static void
+loads_many_parse(ManyJob *job, rapidjson::Document::AllocatorType *pool)
+{
+    rapidjson::Document doc(pool);
+
+    for (;;) {
+        PyThread_acquire_lock(job->lock, WAIT_LOCK);
+        size_t begin = job->next;
+        size_t end = job->count - begin > job->batch ? begin + job->batch : job->count;
+        job->next = end;
+        PyThread_release_lock(job->lock);
+        if (begin == end) {
+            return;
+        }
+
+        for (size_t i = begin; i < end; ++i) {
+            ManyItem& item = job->items[i];
+            if (!item.parse) {
+                continue;
+            }
+            rapidjson::MemoryStream is(item.data, item.length);
+            /* iterative: these threads may have much smaller stacks */
+            doc.ParseStream<rapidjson::kParseIterativeFlag>(is);
+            if (doc.HasParseError()) {
+                item.code = doc.GetParseError();
+            } else if (is.Tell() != item.length) {
+                item.code = rapidjson::kParseErrorDocumentRootNotSingular;
+            } else {
+                job->values[i].Swap(doc);
+            }
+        }
+    }
+}
+
+static void
+loads_many_thread(void *arg)
+{
+    ManyWorker *worker = (ManyWorker *)arg;
+    ManyJob *job = worker->job;
+    bool last;
+
+    loads_many_parse(job, worker->pool);
+    PyThread_acquire_lock(job->lock, WAIT_LOCK);
+    last = --job->running == 0;
+    PyThread_release_lock(job->lock);
+    if (last) {
+        PyThread_release_lock(job->done);
+    }
+}
+
+/* parse all items of `job` on `threads` threads; called without the GIL */
+static void
+loads_many_run(ManyJob *job, ManyWorker *workers, int threads)
+{
+    bool last = false;
+
+    job->running = threads - 1;
+    if (job->running > 0) {
+        PyThread_acquire_lock(job->done, WAIT_LOCK);
+    }
+    for (int i = 1; i < threads; ++i) {
+        if (PyThread_start_new_thread(loads_many_thread, &workers[i]) ==
+            PYTHREAD_INVALID_THREAD_ID) {
+            /* the threads that did start (or this one) take its share */
+            PyThread_acquire_lock(job->lock, WAIT_LOCK);
+            last = --job->running == 0;
+            PyThread_release_lock(job->lock);
+        }
+    }
+    if (last) {
+        PyThread_release_lock(job->done);
+    }
+    loads_many_parse(job, workers[0].pool);
+    if (threads > 1) {
+        PyThread_acquire_lock(job->done, WAIT_LOCK);
+        PyThread_release_lock(job->done);
+    }
+}
+
+static int
+cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* the exception just raised, as an object to return in place */
+static PyObject *
+fetch_exception(void)
+{
+    PyObject *type, *value, *traceback;
+
+    PyErr_Fetch(&type, &value, &traceback);
+    PyErr_NormalizeException(&type, &value, &traceback);
+#ifdef PY3
+    if (value != NULL && traceback != NULL) {
+        PyException_SetTraceback(value, traceback);
+    }
+#endif
+    Py_XDECREF(type);
+    Py_XDECREF(traceback);
+    return value;
+}
+
+static PyObject *
+pyrapidjson_loads_many(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"texts", (char *)"threads", (char *)"cache_values", NULL};
+    PyObject *texts, *seq, *ret;
+    PyObject *py_threads = NULL;
+    PyObject *cache_values = NULL;
+    Py_ssize_t count, i;
+    size_t total = 0;
+    long threads;
+
+    /* Parse arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OO", kwlist,
+                                     &texts, &py_threads, &cache_values))
+        return NULL;
+
+    if (py_threads == NULL || py_threads == Py_None) {
+        threads = cpu_count();
+    } else {
+        threads = PyLong_AsLong(py_threads);
+        if (threads == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        if (threads <= 0) {
+            PyErr_SetString(PyExc_ValueError, "threads must be positive");
+            return NULL;
+        }
+    }
+
+    seq = PySequence_Fast(texts, "texts must be iterable");
+    if (seq == NULL) {
+        return NULL;
+    }
+    count = PySequence_Fast_GET_SIZE(seq);
+    ret = PyList_New(count);
+    if (ret == NULL) {
+        Py_DECREF(seq);
+        return NULL;
+    }
+
+    TextBuffer *buffers = new TextBuffer[count];
+    ManyItem *items = new ManyItem[count];
+    for (i = 0; i < count; ++i) {
+        items[i].parse = buffers[i].Get(PySequence_Fast_GET_ITEM(seq, i));
+        items[i].code = rapidjson::kParseErrorNone;
+        if (items[i].parse) {
+            items[i].data = buffers[i].data;
+            items[i].length = (size_t)buffers[i].length;
+            total += items[i].length;
+        } else {
+            PyList_SET_ITEM(ret, i, fetch_exception());
+        }
+    }
+
+    /* a thread per LOADS_MANY_THREAD_BYTES at most, unless told otherwise */
+    if ((py_threads == NULL || py_threads == Py_None) &&
+        (size_t)threads > total / LOADS_MANY_THREAD_BYTES + 1) {
+        threads = (long)(total / LOADS_MANY_THREAD_BYTES) + 1;
+    }
+    if (threads > count) {
+        threads = count > 0 ? (long)count : 1;
+    }
+
+    ManyJob job;
+    job.items = items;
+    job.values = new rapidjson::Value[count];
+    job.count = (size_t)count;
+    job.batch = job.count / ((size_t)threads * 16) + 1;
+    job.next = 0;
+    job.lock = PyThread_allocate_lock();
+    job.done = PyThread_allocate_lock();
+    rapidjson::Document::AllocatorType *pools =
+        new rapidjson::Document::AllocatorType[threads];
+    ManyWorker *workers = new ManyWorker[threads];
+    for (i = 0; i < threads; ++i) {
+        workers[i].job = &job;
+        workers[i].pool = &pools[i];
+    }
+
+    if (job.lock == NULL || job.done == NULL) {
+        PyErr_NoMemory();
+        Py_CLEAR(ret);
+    } else {
+        STATS_START(parse_timer);
+        Py_BEGIN_ALLOW_THREADS
+        loads_many_run(&job, workers, (int)threads);
+        Py_END_ALLOW_THREADS
+        STATS_STOP(parse_ns, parse_timer);
+        STATS_ADD(decode_calls, count);
+        STATS_ADD(bytes_in, total);
+        for (i = 0; i < threads; ++i) {
+            STATS_ADD(allocator_bytes, pools[i].Capacity());
+        }
+    }
+
+    STATS_START(convert_timer);
+    PyObjectHandler handler(cache_values && PyObject_IsTrue(cache_values));
+    for (i = 0; ret != NULL && i < count; ++i) {
+        PyObject *obj;
+
+        if (!items[i].parse) {
+            continue;
+        }
+        if (items[i].code != rapidjson::kParseErrorNone) {
+            obj = PyObject_CallFunction(PyExc_ValueError, (char *)"s",
+                                        GetParseError_En(items[i].code));
+            if (obj == NULL) {
+                Py_CLEAR(ret);
+                break;
+            }
+        } else if (job.values[i].Accept(handler)) {
+            obj = handler.Result();
+        } else {
+            obj = fetch_exception();
+            handler.Reset();
+        }
+        PyList_SET_ITEM(ret, i, obj);
+    }
+    STATS_STOP(convert_ns, convert_timer);
+
+    delete[] workers;
+    delete[] job.values;
+    delete[] pools;
+    if (job.lock != NULL) {
+        PyThread_free_lock(job.lock);
+    }
+    if (job.done != NULL) {
+        PyThread_free_lock(job.done);
+    }
+    delete[] items;
+    delete[] buffers;
+    Py_DECREF(seq);
+    return ret;
+}
+
+/*
+ * loads_columns(): an array of flat records decoded column by column.
+ * Numeric and bool columns go straight into contiguous typed buffers and
+ * str columns into one block of UTF-8, so the parse itself creates no
+ * Python object (and runs without the GIL for large texts); only the str
+ * columns are turned into lists afterwards.
+ */
+enum ColumnType {
+    COLUMN_INT64,
+    COLUMN_INT32,
+    COLUMN_FLOAT64,
+    COLUMN_FLOAT32,
+    COLUMN_BOOL,
+    COLUMN_STR
+};
+
+static const struct {
+    const char *name;
+    ColumnType type;
+    const char *format;             /* struct module format of the buffer */
+    size_t itemsize;
+} column_types[] = {
+    {"int64", COLUMN_INT64, "q", sizeof(long long)},
+    {"int32", COLUMN_INT32, "i", sizeof(int)},
+    {"float64", COLUMN_FLOAT64, "d", sizeof(double)},
+    {"float32", COLUMN_FLOAT32, "f", sizeof(float)},
+    {"bool", COLUMN_BOOL, "?", sizeof(char)},
+    {"str", COLUMN_STR, NULL, 0},
+};
+
+#define COLUMN_NULL ((size_t)-1)
+
+struct Column {
+    std::string name;
+    ColumnType type;
+    const char *format;
+    size_t itemsize;
+    std::vector<char> data;         /* values, or the UTF-8 of str values back to back */
+    std::vector<size_t> ends;       /* str columns: end of each value in data, or COLUMN_NULL */
+    size_t rows;
+
+    Column() : rows(0) {}
+};
+
+/*
+ * SAX handler filling the columns; runs without the GIL, so errors are
+ * kept as a message and raised by the caller.
+ */
+struct ColumnHandler {
+    typedef char Ch;
+
+    std::vector<Column>& columns;
+    Column *current;                /* column of the member being read, if any */
+    int depth;
+    size_t row;
+    std::string error;
+
+    explicit ColumnHandler(std::vector<Column>& columns_)
+        : columns(columns_), current(NULL), depth(0), row(0) {}
+
+    bool Fail(const char *what, const Column *column) {
+        std::ostringstream message;
+
+        if (column) {
+            message << "row " << row << ": '" << column->name << "' ";
+        }
+        message << what;
+        error = message.str();
+        return false;
+    }
+
+    template <typename T>
+    bool Append(T value) {
+        const char *p = (const char *)&value;
+
+        current->data.insert(current->data.end(), p, p + sizeof(T));
+        current->rows++;
+        current = NULL;
+        return true;
+    }
+
+    /* true when the value belongs to no column and is skipped */
+    bool Skip() {
+        return depth > 2 || (depth == 2 && current == NULL);
+    }
+
+    bool Number(long long value, bool overflow, double as_double) {
+        if (Skip()) {
+            return true;
+        }
+        if (depth != 2) {
+            return Fail("expected an array of objects", NULL);
+        }
+        switch (current->type) {
+        case COLUMN_INT64:
+            if (overflow) {
+                return Fail("is out of range for int64", current);
+            }
+            return Append<long long>(value);
+        case COLUMN_INT32:
+            if (overflow || value < -2147483647LL - 1 || value > 2147483647LL) {
+                return Fail("is out of range for int32", current);
+            }
+            return Append<int>((int)value);
+        case COLUMN_FLOAT64:
+            return Append<double>(as_double);
+        case COLUMN_FLOAT32:
+            return Append<float>((float)as_double);
+        default:
+            return Fail("is not a number column", current);
+        }
+    }
+
+    bool Null() {
+        if (Skip()) {
+            return true;
+        }
+        if (depth != 2) {
+            return Fail("expected an array of objects", NULL);
+        }
+        if (current->type != COLUMN_STR) {
+            return Fail("is null", current);
+        }
+        current->ends.push_back(COLUMN_NULL);
+        current->rows++;
+        current = NULL;
+        return true;
+    }
+
+    bool Bool(bool b) {
+        if (Skip()) {
+            return true;
+        }
+        if (depth != 2) {
+            return Fail("expected an array of objects", NULL);
+        }
+        if (current->type != COLUMN_BOOL) {
+            return Fail("is not a bool column", current);
+        }
+        return Append<char>(b ? 1 : 0);
+    }
+
+    bool Int(int i) { return Number(i, false, (double)i); }
+    bool Uint(unsigned u) { return Number((long long)u, false, (double)u); }
+    bool Int64(int64_t i) { return Number(i, false, (double)i); }
+    bool Uint64(uint64_t u) {
+        return Number((long long)u, u > 9223372036854775807ULL, (double)u);
+    }
+
+    bool Double(double d) {
+        if (Skip()) {
+            return true;
+        }
+        if (depth != 2) {
+            return Fail("expected an array of objects", NULL);
+        }
+        switch (current->type) {
+        case COLUMN_FLOAT64:
+            return Append<double>(d);
+        case COLUMN_FLOAT32:
+            return Append<float>((float)d);
+        case COLUMN_INT64:
+        case COLUMN_INT32:
+            return Fail("is not an integer", current);
+        default:
+            return Fail("is not a number column", current);
+        }
+    }
+
+    bool RawNumber(const char *str, rapidjson::SizeType length, bool copy) {
+        return Fail("raw numbers are not supported", NULL);
+    }
+
+    bool String(const char *str, rapidjson::SizeType length, bool copy) {
+        if (Skip()) {
+            return true;
+        }
+        if (depth != 2) {
+            return Fail("expected an array of objects", NULL);
+        }
+        if (current->type != COLUMN_STR) {
+            return Fail("is not a str column", current);
+        }
+        current->data.insert(current->data.end(), str, str + length);
+        current->ends.push_back(current->data.size());
+        current->rows++;
+        current = NULL;
+        return true;
+    }
+
+    bool Key(const char *str, rapidjson::SizeType length, bool copy) {
+        if (depth != 2) {
+            return true;
+        }
+        current = NULL;
+        for (size_t i = 0; i < columns.size(); ++i) {
+            if (columns[i].name.size() == length &&
+                memcmp(columns[i].name.data(), str, length) == 0) {
+                current = &columns[i];
+                break;
+            }
+        }
+        if (current && current->rows != row) {
+            return Fail("appears twice", current);
+        }
+        return true;
+    }
+
+    bool Start(bool object) {
+        if (Skip()) {
+            depth++;
+            return true;
+        }
+        if (depth == 2) {
+            return Fail("is not a scalar", current);
+        }
+        if (object != (depth == 1)) {
+            return Fail("expected an array of objects", NULL);
+        }
+        depth++;
+        return true;
+    }
+
+    bool StartObject() { return Start(true); }
+    bool StartArray() { return Start(false); }
+
+    bool EndObject(rapidjson::SizeType member_count) {
+        if (--depth == 1) {
+            current = NULL;
+            for (size_t i = 0; i < columns.size(); ++i) {
+                if (columns[i].rows == row) {
+                    return Fail("is missing", &columns[i]);
+                }
+            }
+            row++;
+        }
+        return true;
+    }
+
+    bool EndArray(rapidjson::SizeType element_count) {
+        depth--;
+        return true;
+    }
+};
+
+/* owner of a numeric column, exported through the buffer protocol */
+typedef struct {
+    PyObject_HEAD
+    std::vector<char> *data;
+    const char *format;
+    Py_ssize_t itemsize;
+    Py_ssize_t length;
+} ColumnBufferObject;
+
+static PyTypeObject ColumnBufferType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "rapidjson.ColumnBuffer",       /* tp_name */
+    sizeof(ColumnBufferObject),     /* tp_basicsize */
+};
+
+static void
+ColumnBuffer_dealloc(ColumnBufferObject *self)
+{
+    delete self->data;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int
+ColumnBuffer_getbuffer(ColumnBufferObject *self, Py_buffer *view, int flags)
+{
+    static char empty = 0;
+
+    /* read-only by design (see loads_columns()); BufferError for PyBUF_WRITABLE */
+    if (PyBuffer_FillInfo(view, (PyObject *)self,
+                          self->data->empty() ? &empty : &(*self->data)[0],
+                          self->length * self->itemsize, 1, flags) < 0) {
+        return -1;
+    }
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char *)self->format : NULL;
+    view->shape = (flags & PyBUF_ND) ? &self->length : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &self->itemsize : NULL;
+    return 0;
+}
+
+static PyBufferProcs ColumnBuffer_as_buffer;
+
+/* a memoryview of `column`, whose data moves into the buffer object */
+static PyObject *
+column2memoryview(Column& column)
+{
+    ColumnBufferObject *buffer;
+    PyObject *view;
+
+    buffer = PyObject_New(ColumnBufferObject, &ColumnBufferType);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->data = new std::vector<char>();
+    buffer->data->swap(column.data);
+    buffer->format = column.format;
+    buffer->itemsize = (Py_ssize_t)column.itemsize;
+    buffer->length = (Py_ssize_t)column.rows;
+
+    view = PyMemoryView_FromObject((PyObject *)buffer);
+    Py_DECREF(buffer);
+    return view;
+}
+
+/* the values of a str column as a list of str and None */
+static PyObject *
+column2list(const Column& column)
+{
+    PyObject *list, *item;
+    const char *data = column.data.empty() ? "" : &column.data[0];
+    size_t start = 0;
+
+    list = PyList_New((Py_ssize_t)column.rows);
+    if (list == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < column.rows; ++i) {
+        size_t end = column.ends[i];
+
+        if (end == COLUMN_NULL) {
+            Py_INCREF(Py_None);
+            item = Py_None;
+        } else {
+            item = utf8_to_unicode(data + start, end - start);
+            if (item == NULL) {
+                Py_DECREF(list);
+                return NULL;
+            }
+            start = end;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t)i, item);
+    }
+    return list;
+}
+
+/* {name: type name} of loads_columns() into `columns` */
+static bool
+columns2spec(PyObject *spec, std::vector<Column>& columns)
+{
+    PyObject *name, *type;
+    Py_ssize_t pos = 0;
+
+    if (!PyDict_Check(spec)) {
+        PyErr_SetString(PyExc_TypeError, "columns must be a dict of column types");
+        return false;
+    }
+    while (PyDict_Next(spec, &pos, &name, &type)) {
+        const char *name_str, *type_str;
+        Py_ssize_t name_length;
+        size_t i;
+
+#ifdef PY3
+        if (!PyUnicode_Check(name) || !PyUnicode_Check(type)) {
+            PyErr_SetString(PyExc_TypeError, "column names and types must be str");
+            return false;
+        }
+        name_str = PyUnicode_AsUTF8AndSize(name, &name_length);
+        type_str = PyUnicode_AsUTF8(type);
+        if (name_str == NULL || type_str == NULL) {
+            return false;
+        }
+#else
+        if (!PyString_Check(name) || !PyString_Check(type)) {
+            PyErr_SetString(PyExc_TypeError, "column names and types must be str");
+            return false;
+        }
+        name_str = PyString_AS_STRING(name);
+        name_length = PyString_GET_SIZE(name);
+        type_str = PyString_AS_STRING(type);
+#endif
+        for (i = 0; i < sizeof(column_types) / sizeof(column_types[0]); ++i) {
+            if (strcmp(type_str, column_types[i].name) == 0) {
+                break;
+            }
+        }
+        if (i == sizeof(column_types) / sizeof(column_types[0])) {
+            PyErr_Format(PyExc_ValueError, "unknown column type '%.100s'", type_str);
+            return false;
+        }
+        columns.push_back(Column());
+        columns.back().name.assign(name_str, (size_t)name_length);
+        columns.back().type = column_types[i].type;
+        columns.back().format = column_types[i].format;
+        columns.back().itemsize = column_types[i].itemsize;
+    }
+    return true;
+}
+
+static PyObject *
+pyrapidjson_loads_columns(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"text", (char *)"columns", (char *)"release_gil", NULL};
+    PyObject *text, *spec;
+    PyObject *release_gil = NULL;
+    PyObject *result, *name, *column;
+    std::vector<Column> columns;
+    rapidjson::Reader reader;
+    TextBuffer buffer;
+    bool nogil;
+
+    /* Parse arguments */
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|O", kwlist,
+                                     &text, &spec, &release_gil))
+        return NULL;
+
+    if (!columns2spec(spec, columns) || !buffer.Get(text)) {
+        return NULL;
+    }
+
+    ColumnHandler handler(columns);
+    rapidjson::MemoryStream is(buffer.data, (size_t)buffer.length);
+    nogil = use_nogil(release_gil, (size_t)buffer.length);
+
+    STATS_START(timer);
+    if (nogil) {
+        Py_BEGIN_ALLOW_THREADS
+        reader.Parse<rapidjson::kParseDefaultFlags>(is, handler);
+        Py_END_ALLOW_THREADS
+    } else {
+        reader.Parse<rapidjson::kParseDefaultFlags>(is, handler);
+    }
+    STATS_STOP(decode_ns, timer);
+    STATS_ADD(decode_calls, 1);
+    STATS_ADD(bytes_in, is.Tell());
+
+    result = NULL;
+    if (!handler.error.empty()) {
+        PyErr_SetString(PyExc_ValueError, handler.error.c_str());
+    } else if (reader.HasParseError()) {
+        PyErr_SetString(PyExc_ValueError,
+                        GetParseError_En(reader.GetParseErrorCode()));
+    } else if (check_consumed(is, (size_t)buffer.length)) {
+        result = PyDict_New();
+    }
+    for (size_t i = 0; i < columns.size() && result != NULL; ++i) {
+        if (columns[i].type == COLUMN_STR) {
+            column = column2list(columns[i]);
+        } else {
+            column = column2memoryview(columns[i]);
+        }
+        name = PyString_FromStringAndSize(columns[i].name.data(),
+                                          (Py_ssize_t)columns[i].name.size());
+        if (column == NULL || name == NULL ||
+            PyDict_SetItem(result, name, column) < 0) {
+            Py_XDECREF(column);
+            Py_XDECREF(name);
+            Py_CLEAR(result);
+            break;
+        }
+        Py_DECREF(column);
+        Py_DECREF(name);
+    }
+
+    return result;
+}
+
+
+/*
+ * rapidjson.Document: owns a parsed rapidjson::Document and turns its
+ * sub-values into Python objects only when they are accessed. Objects and
+ * arrays come back as Document views sharing the same root; every value
+ * handed out is cached on the view it was accessed through.
+ */
+typedef struct {
+    PyObject_HEAD
+    rapidjson::Document *doc;       /* owned by the root view only */
+    PyObject *root;                 /* root view, NULL for the root itself */
+    const rapidjson::Value *value;
+    PyObject *cache;                /* key or index -> value, created lazily */
+} DocumentObject;
+
+PyDoc_STRVAR(Document__doc__,
+             "Document(text) -> JSON document converted to Python objects on access");
+PyDoc_STRVAR(Document_get__doc__,
+             "D.get(pointer[, default]) -> value at JSON Pointer, or default");
+PyDoc_STRVAR(Document_to_python__doc__,
+             "D.to_python() -> the whole value as dict/list/str/...");
+
+static PyTypeObject DocumentType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "rapidjson.Document",           /* tp_name */
+    sizeof(DocumentObject),         /* tp_basicsize */
+};
+
+static PyObject *
+Document_wrap(DocumentObject *parent, const rapidjson::Value& value)
+{
+    if (value.IsObject() || value.IsArray()) {
+        DocumentObject *view = PyObject_GC_New(DocumentObject, &DocumentType);
+        if (view == NULL) {
+            return NULL;
+        }
+        view->doc = NULL;
+        view->root = parent->root ? parent->root : (PyObject *)parent;
+        Py_INCREF(view->root);
+        view->value = &value;
+        view->cache = NULL;
+        PyObject_GC_Track(view);
+        return (PyObject *)view;
+    }
+
+    PyObjectHandler handler;
+    if (!value.Accept(handler)) {
+        return NULL;
+    }
+    return handler.Result();
+}
+
+/*
+ * the value stored under `key` in the view's cache, converted on first use.
+ * A view may be shared between threads: the cache is only touched under the
+ * view's lock, and when two threads convert the same value the first one
+ * stored wins, so every thread gets the same object.
+ */
+static PyObject *
+Document_cached(DocumentObject *self, PyObject *key, const rapidjson::Value& value)
+{
+    PyObject *item, *cached = NULL;
+    bool failed;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if (self->cache == NULL) {
+        self->cache = PyDict_New();
+    }
+    failed = (self->cache == NULL);
+    if (!failed) {
+        cached = PyDict_GetItem(self->cache, key);
+        Py_XINCREF(cached);
+    }
+    Py_END_CRITICAL_SECTION();
+    if (cached != NULL || failed) {
+        return cached;
+    }
+
+    item = Document_wrap(self, value);
+    if (item == NULL) {
+        return NULL;
+    }
+    Py_BEGIN_CRITICAL_SECTION(self);
+    cached = PyDict_GetItem(self->cache, key);
+    if (cached == NULL && PyDict_SetItem(self->cache, key, item) == 0) {
+        cached = item;
+    }
+    Py_XINCREF(cached);
+    Py_END_CRITICAL_SECTION();
+    Py_DECREF(item);
+    return cached;
+}
+
+/* the last member called `name`, like the dict a full conversion builds */
+static const rapidjson::Value *
+Document_find_member(const rapidjson::Value& object, const char *name,
+                     size_t length)
+{
+    const rapidjson::Value *found = NULL;
+
+    for (rapidjson::Value::ConstMemberIterator itr = object.MemberBegin();
+         itr != object.MemberEnd(); ++itr) {
+        if (itr->name.GetStringLength() == length &&
+            memcmp(itr->name.GetString(), name, length) == 0) {
+            found = &itr->value;
+        }
+    }
+    return found;
+}
+
+static inline bool
+Document_is_key(PyObject *key)
+{
+#ifdef PY3
+    return PyUnicode_Check(key);
+#else
+    return PyUnicode_Check(key) || PyString_Check(key);
+#endif
+}
+
+static PyObject *
+Document_item(DocumentObject *self, Py_ssize_t index)
+{
+    const rapidjson::Value& value = *self->value;
+    PyObject *key, *item;
+
+    if (index < 0) {
+        index += (Py_ssize_t)value.Size();
+    }
+    if (index < 0 || index >= (Py_ssize_t)value.Size()) {
+        PyErr_SetString(PyExc_IndexError, "Document index out of range");
+        return NULL;
+    }
+    key = PyInt_FromLong((long)index);
+    if (key == NULL) {
+        return NULL;
+    }
+    item = Document_cached(self, key, value[(rapidjson::SizeType)index]);
+    Py_DECREF(key);
+    return item;
+}
+
+static PyObject *
+Document_subscript(DocumentObject *self, PyObject *key)
+{
+    const rapidjson::Value& value = *self->value;
+
+    if (value.IsObject()) {
+        const rapidjson::Value *found = NULL;
+        TextBuffer name;
+
+        if (!Document_is_key(key)) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        }
+        if (!name.Get(key)) {
+            return NULL;
+        }
+        found = Document_find_member(value, name.data, (size_t)name.length);
+        if (found == NULL) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        }
+        return Document_cached(self, key, *found);
+    }
+    if (value.IsArray()) {
+        Py_ssize_t index;
+
+        if (!PyIndex_Check(key)) {
+            PyErr_Format(PyExc_TypeError,
+                         "Document indices must be integers, not %.200s",
+                         Py_TYPE(key)->tp_name);
+            return NULL;
+        }
+        index = PyNumber_AsSsize_t(key, PyExc_IndexError);
+        if (index == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+        return Document_item(self, index);
+    }
+
+    PyErr_SetString(PyExc_TypeError, "JSON value is not an object or array");
+    return NULL;
+}
+
+static Py_ssize_t
+Document_length(DocumentObject *self)
+{
+    const rapidjson::Value& value = *self->value;
+
+    if (value.IsObject()) {
+        return (Py_ssize_t)value.MemberCount();
+    }
+    if (value.IsArray()) {
+        return (Py_ssize_t)value.Size();
+    }
+    PyErr_SetString(PyExc_TypeError, "JSON value is not an object or array");
+    return -1;
+}
+
+static PyObject *
+Document_to_python(DocumentObject *self)
+{
+    PyObjectHandler handler;
+
+    if (!self->value->Accept(handler)) {
+        return NULL;
+    }
+    return handler.Result();
+}
+
+static int
+Document_contains(DocumentObject *self, PyObject *item)
+{
+    const rapidjson::Value& value = *self->value;
+
+    if (value.IsObject()) {
+        TextBuffer name;
+
+        if (!Document_is_key(item)) {
+            return 0;
+        }
+        if (!name.Get(item)) {
+            return -1;
+        }
+        return Document_find_member(value, name.data, (size_t)name.length) != NULL;
+    }
+    if (value.IsArray()) {
+        for (rapidjson::SizeType i = 0; i < value.Size(); ++i) {
+            PyObject *element = Document_item(self, (Py_ssize_t)i);
+            int cmp;
+
+            if (element && PyObject_TypeCheck(element, &DocumentType)) {
+                /* compare containers by value, not by view identity */
+                PyObject *converted = Document_to_python((DocumentObject *)element);
+                Py_DECREF(element);
+                element = converted;
+            }
+            if (element == NULL) {
+                return -1;
+            }
+            cmp = PyObject_RichCompareBool(element, item, Py_EQ);
+            Py_DECREF(element);
+            if (cmp != 0) {
+                return cmp;
+            }
+        }
+        return 0;
+    }
+    PyErr_SetString(PyExc_TypeError, "JSON value is not an object or array");
+    return -1;
+}
+
+static PyObject *
+Document_iter(DocumentObject *self)
+{
+    const rapidjson::Value& value = *self->value;
+    PyObject *items, *iter;
+
+    if (value.IsObject()) {
+        /* iterate over the keys, as a dict does */
+        items = PyList_New(value.MemberCount());
+        if (items == NULL) {
+            return NULL;
+        }
+        Py_ssize_t i = 0;
+        for (rapidjson::Value::ConstMemberIterator itr = value.MemberBegin();
+             itr != value.MemberEnd(); ++itr, ++i) {
+            PyObject *key = key_cache_get(itr->name.GetString(),
+                                          itr->name.GetStringLength());
+            if (key == NULL) {
+                Py_DECREF(items);
+                return NULL;
+            }
+            PyList_SET_ITEM(items, i, key);
+        }
+    }
+    else if (value.IsArray()) {
+        items = PyList_New(value.Size());
+        if (items == NULL) {
+            return NULL;
+        }
+        for (rapidjson::SizeType i = 0; i < value.Size(); ++i) {
+            PyObject *element = Document_item(self, (Py_ssize_t)i);
+            if (element == NULL) {
+                Py_DECREF(items);
+                return NULL;
+            }
+            PyList_SET_ITEM(items, i, element);
+        }
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError, "JSON value is not an object or array");
+        return NULL;
+    }
+
+    iter = PyObject_GetIter(items);
+    Py_DECREF(items);
+    return iter;
+}
+
+static PyObject *
+Document_get(DocumentObject *self, PyObject *args)
+{
+    PyObject *pointer, *current, *next;
+    PyObject *default_value = Py_None;
+    TextBuffer source;
+
+    if (!PyArg_ParseTuple(args, "O|O:get", &pointer, &default_value))
+        return NULL;
+
+    if (!Document_is_key(pointer)) {
+        PyErr_SetString(PyExc_TypeError, "JSON Pointer must be a string");
+        return NULL;
+    }
+    if (!source.Get(pointer)) {
+        return NULL;
+    }
+    rapidjson::Pointer ptr(source.data, (size_t)source.length);
+    if (!ptr.IsValid()) {
+        PyErr_Format(PyExc_ValueError, "invalid JSON Pointer at offset %d",
+                     (int)ptr.GetParseErrorOffset());
+        return NULL;
+    }
+
+    /* walk the tokens through the views, so each step is cached */
+    const rapidjson::Pointer::Token *tokens = ptr.GetTokens();
+    current = (PyObject *)self;
+    Py_INCREF(current);
+    for (size_t i = 0; i < ptr.GetTokenCount(); ++i) {
+        const rapidjson::Pointer::Token& token = tokens[i];
+        DocumentObject *view = (DocumentObject *)current;
+
+        next = NULL;
+        if (!PyObject_TypeCheck(current, &DocumentType)) {
+            goto not_found;
+        }
+        if (view->value->IsObject()) {
+            const rapidjson::Value *found =
+                Document_find_member(*view->value, token.name, token.length);
+            if (found == NULL) {
+                goto not_found;
+            }
+            PyObject *key = key_cache_get(token.name, token.length);
+            if (key != NULL) {
+                next = Document_cached(view, key, *found);
+                Py_DECREF(key);
+            }
+        }
+        else {
+            if (token.index == rapidjson::kPointerInvalidIndex ||
+                token.index >= view->value->Size()) {
+                goto not_found;
+            }
+            next = Document_item(view, (Py_ssize_t)token.index);
+        }
+        Py_DECREF(current);
+        current = next;
+        if (current == NULL) {
+            return NULL;
+        }
+    }
+    return current;
+
+not_found:
+    Py_DECREF(current);
+    Py_INCREF(default_value);
+    return default_value;
+}
+
+static PyObject *
+Document_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"text", (char *)"release_gil", NULL};
+    PyObject *text;
+    PyObject *release_gil = NULL;
+    DocumentObject *self;
+    TextBuffer buffer;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:Document", kwlist,
+                                     &text, &release_gil))
+        return NULL;
+
+    if (!buffer.Get(text)) {
+        return NULL;
+    }
+
+    self = (DocumentObject *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->root = NULL;
+    self->cache = NULL;
+    self->doc = new rapidjson::Document();
+    self->value = self->doc;
+    if (!buffer2doc<rapidjson::kParseDefaultFlags>(
+            *self->doc, buffer.data, (size_t)buffer.length,
+            use_nogil(release_gil, (size_t)buffer.length))) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject *)self;
+}
+
+static int
+Document_traverse(DocumentObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->root);
+    Py_VISIT(self->cache);
+    return 0;
+}
+
+static int
+Document_clear(DocumentObject *self)
+{
+    Py_CLEAR(self->cache);
+    Py_CLEAR(self->root);
+    return 0;
+}
+
+static void
+Document_dealloc(DocumentObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    Document_clear(self);
+    delete self->doc;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyMappingMethods Document_as_mapping = {
+    (lenfunc)Document_length,           /* mp_length */
+    (binaryfunc)Document_subscript,     /* mp_subscript */
+    0,                                  /* mp_ass_subscript */
+};
+
+static PySequenceMethods Document_as_sequence = {
+    (lenfunc)Document_length,           /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    0,                                  /* sq_item */
+    0,                                  /* sq_slice */
+    0,                                  /* sq_ass_item */
+    0,                                  /* sq_ass_slice */
+    (objobjproc)Document_contains,      /* sq_contains */
+};
+
+static PyMethodDef Document_methods[] = {
+    {"get", (PyCFunction)Document_get, METH_VARARGS, Document_get__doc__},
+    {"to_python", (PyCFunction)Document_to_python, METH_NOARGS,
+     Document_to_python__doc__},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+/*
+ * rapidjson.Decoder / rapidjson.Encoder: loads() and dumps() with their
+ * options bound once, keeping the parse stacks, the allocator pool and the
+ * output buffer from one call to the next instead of reallocating them.
+ * At most max_retained bytes of each are kept after a call.
+ */
+typedef struct {
+    PyObject_HEAD
+    FieldSpec *fields;
+    PyObjectHandler *handler;
+    rapidjson::Reader *reader;
+    std::vector<char> *arena;       /* first chunk of `pool`, grows to fit */
+    rapidjson::Document::AllocatorType *pool;
+    int release_gil;                /* -1: decided by size */
+    size_t max_retained;
+    bool busy;
+    std::vector<char> *pending;     /* feed() input not parsed yet */
+    size_t scanned;                 /* how far the token ending `pending` was looked at */
+    bool feeding;                   /* a top-level value is partly parsed */
+} DecoderObject;
+
+typedef struct {
+    PyObject_HEAD
+    rapidjson::StringBuffer *buffer;
+    /* exactly one of the two, as chosen by ensure_ascii */
+    rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, rapidjson::ASCII<> > *ascii_writer;
+    rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, rapidjson::UTF8<> > *utf8_writer;
+    PyObject *default_;             /* NULL for none */
+    bool namedtuple_as_object;
+    size_t max_retained;
+    bool busy;
+} EncoderObject;
+
+PyDoc_STRVAR(Decoder__doc__,
+             "Decoder(cache_values=False, release_gil=None, fields=None, max_retained=1048576)\n\n"
+             "Reusable loads(); keeps up to max_retained bytes of parser memory between calls.\n"
+             "feed() and close() parse a stream of values as it arrives");
+PyDoc_STRVAR(Decoder_decode__doc__, "D.decode(text) -> object, as loads(text)");
+PyDoc_STRVAR(Decoder_feed__doc__,
+             "D.feed(chunk) -> list of the top-level values completed by chunk\n\n"
+             "Incremental parsing of a stream of JSON values; a value split\n"
+             "across chunks is returned once its last chunk has been fed");
+PyDoc_STRVAR(Decoder_close__doc__,
+             "D.close() -> list of the values still pending at the end of the input\n\n"
+             "Raises ValueError if the input ends inside a value");
+PyDoc_STRVAR(Encoder__doc__,
+             "Encoder(ensure_ascii=True, max_retained=1048576, default=None,\n"
+             "        namedtuple_as_object=False)\n\n"
+             "Reusable dumps(); keeps up to max_retained bytes of output buffer between calls");
+PyDoc_STRVAR(Encoder_encode__doc__, "E.encode(obj) -> str, as dumps(obj)");
+
+static PyTypeObject DecoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "rapidjson.Decoder",            /* tp_name */
+    sizeof(DecoderObject),          /* tp_basicsize */
+};
+
+static PyTypeObject EncoderType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "rapidjson.Encoder",            /* tp_name */
+    sizeof(EncoderObject),          /* tp_basicsize */
+};
+
+static PyObject *
+Decoder_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"cache_values", (char *)"release_gil", (char *)"fields", (char *)"max_retained", NULL};
+    PyObject *cache_values = NULL;
+    PyObject *release_gil = NULL;
+    PyObject *fields = NULL;
+    Py_ssize_t max_retained = RETAINED_CAPACITY;
+    DecoderObject *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOn:Decoder", kwlist,
+                                     &cache_values, &release_gil, &fields,
+                                     &max_retained))
+        return NULL;
+
+    if (max_retained < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_retained must not be negative");
+        return NULL;
+    }
+
+    self = (DecoderObject *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->fields = NULL;
+    if (fields && fields != Py_None) {
+        self->fields = new FieldSpec();
+        if (!fields2spec(fields, *self->fields)) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+    self->handler = new PyObjectHandler(
+        cache_values && PyObject_IsTrue(cache_values), self->fields);
+    self->reader = new rapidjson::Reader();
+    self->arena = new std::vector<char>();
+    self->pool = new rapidjson::Document::AllocatorType();
+    if (release_gil == NULL || release_gil == Py_None) {
+        self->release_gil = -1;
+    } else {
+        self->release_gil = PyObject_IsTrue(release_gil) == 1;
+    }
+    self->max_retained = (size_t)max_retained;
+    self->busy = false;
+    self->pending = new std::vector<char>();
+    self->scanned = 0;
+    self->feeding = false;
+
+    return (PyObject *)self;
+}
+
+static void
+Decoder_dealloc(DecoderObject *self)
+{
+    delete self->pending;
+    delete self->handler;
+    delete self->reader;
+    delete self->pool;
+    delete self->arena;
+    delete self->fields;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* keep what the last call needed for the next one, up to max_retained */
+static void
+Decoder_retain(DecoderObject *self, size_t length, bool nogil)
+{
+    self->handler->Trim(self->max_retained);
+
+    if (!nogil) {
+        /* the reader keeps its stack, which holds one string at a time */
+        if (length > self->max_retained) {
+            delete self->reader;
+            self->reader = new rapidjson::Reader();
+        }
+        return;
+    }
+
+    size_t used = self->pool->Size();
+    self->pool->Clear();
+    if (used > self->arena->size()) {
+        /* room for the chunk header and a little growth */
+        size_t size = used + used / 4 + 64;
+        if (size > self->max_retained) {
+            return;
+        }
+        delete self->pool;
+        self->pool = NULL;
+        self->arena->resize(size);
+        self->pool = new rapidjson::Document::AllocatorType(
+            &(*self->arena)[0], self->arena->size());
+    }
+}
+
+static PyObject *
+Decoder_decode(DecoderObject *self, PyObject *text)
+{
+    TextBuffer buffer;
+    PyObject *ret;
+    bool nogil;
+
+    if (!busy_enter((PyObject *)self, &self->busy)) {
+        PyErr_SetString(PyExc_RuntimeError, "Decoder is already in use");
+        return NULL;
+    }
+    if (self->feeding || !self->pending->empty()) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Decoder has unfinished feed() input; call close() first");
+        busy_leave((PyObject *)self, &self->busy);
+        return NULL;
+    }
+    if (!buffer.Get(text)) {
+        busy_leave((PyObject *)self, &self->busy);
+        return NULL;
+    }
+
+    if (self->release_gil < 0) {
+        nogil = (size_t)buffer.length >= NOGIL_THRESHOLD;
+    } else {
+        nogil = self->release_gil == 1;
+    }
+
+    self->handler->Reset();
+    ret = buffer2pyobj<rapidjson::kParseDefaultFlags>(
+        buffer.data, (size_t)buffer.length, *self->handler, nogil,
+        self->reader, self->pool);
+    self->handler->Reset();
+    Decoder_retain(self, (size_t)buffer.length, nogil);
+    busy_leave((PyObject *)self, &self->busy);
+
+    return ret;
+}
+
+/*
+ * Decoder.feed(): the document arrives in chunks. rapidjson's iterative
+ * parser keeps its state between IterativeParseNext() calls, but treats
+ * the end of its input as the end of the document, so a step is only
+ * taken once the token it reads is complete; the unread rest of the input
+ * (part of one token at most) is kept for the next chunk.
+ */
+static inline size_t
+feed_skip_whitespace(const char *text, size_t pos, size_t length)
+{
+    while (pos < length && (text[pos] == ' ' || text[pos] == '\n' ||
+                            text[pos] == '\r' || text[pos] == '\t')) {
+        pos++;
+    }
+    return pos;
+}
+
+/*
+ * Whether the token at text[pos] is complete within `length` bytes.
+ * `scanned` remembers how far an unfinished string or number has been
+ * looked at, so a long one is not rescanned for every chunk.
+ */
+static bool
+feed_token_complete(const char *text, size_t pos, size_t length, size_t *scanned)
+{
+    size_t i = *scanned > pos + 1 ? *scanned : pos + 1;
+
+    switch (text[pos]) {
+    case '"':
+        while (i < length) {
+            if (text[i] == '"') {
+                return true;
+            }
+            if (text[i] == '\\') {
+                if (i + 1 >= length) {
+                    break;
+                }
+                i++;
+            }
+            i++;
+        }
+        *scanned = i;
+        return false;
+    case 't':
+    case 'n':
+        return pos + 4 <= length;
+    case 'f':
+        return pos + 5 <= length;
+    default:
+        if (text[pos] != '-' && (text[pos] < '0' || text[pos] > '9')) {
+            /* structural, or invalid and reported by the parser */
+            return true;
+        }
+        while (i < length && ((text[i] >= '0' && text[i] <= '9') || text[i] == '.' ||
+                              text[i] == 'e' || text[i] == 'E' ||
+                              text[i] == '+' || text[i] == '-')) {
+            i++;
+        }
+        *scanned = i;
+        /* a number ends only where something else starts */
+        return i < length;
+    }
+}
+
+/*
+ * Whether IterativeParseNext() can take its next step from text[pos]: it
+ * reads the next token and, past a ',' or ':', the one after it too.
+ */
+static bool
+feed_step_ready(const char *text, size_t pos, size_t length, size_t *scanned)
+{
+    if (!feed_token_complete(text, pos, length, scanned)) {
+        return false;
+    }
+    if (text[pos] != ',' && text[pos] != ':') {
+        return true;
+    }
+    pos = feed_skip_whitespace(text, pos + 1, length);
+    return pos < length && feed_token_complete(text, pos, length, scanned);
+}
+
+/* forget the input of an unfinished feed() */
+static void
+Decoder_feed_reset(DecoderObject *self)
+{
+    self->pending->clear();
+    self->scanned = 0;
+    self->feeding = false;
+    self->handler->Reset();
+    Decoder_retain(self, self->pending->capacity(), false);
+    if (self->pending->capacity() > self->max_retained) {
+        std::vector<char>().swap(*self->pending);
+    }
+}
+
+/*
+ * Parse as much of the pending input as is complete, returning the list of
+ * the top-level values finished on the way; with `final`, the input is
+ * over and an unfinished value is an error.
+ */
+static PyObject *
+Decoder_drain(DecoderObject *self, bool final)
+{
+    std::vector<char>& pending = *self->pending;
+    const char *text = pending.empty() ? "" : &pending[0];
+    size_t length = pending.size();
+    size_t pos = 0;
+    PyObject *values, *value;
+
+    values = PyList_New(0);
+    if (values == NULL) {
+        return NULL;
+    }
+    for (;;) {
+        pos = feed_skip_whitespace(text, pos, length);
+        if (pos == length && !(final && self->feeding)) {
+            break;
+        }
+        if (!final && !feed_step_ready(text, pos, length, &self->scanned)) {
+            break;
+        }
+        if (!self->feeding) {
+            self->reader->IterativeParseInit();
+            self->feeding = true;
+        }
+
+        rapidjson::MemoryStream is(text + pos, length - pos);
+        bool ok = self->reader->IterativeParseNext<rapidjson::kParseStopWhenDoneFlag>(
+            is, *self->handler);
+        pos += is.Tell();
+        STATS_ADD(bytes_in, is.Tell());
+        self->scanned = 0;
+        if (!ok) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_ValueError,
+                                GetParseError_En(self->reader->GetParseErrorCode()));
+            }
+            Py_DECREF(values);
+            Decoder_feed_reset(self);
+            return NULL;
+        }
+        if (self->reader->IterativeParseComplete()) {
+            self->feeding = false;
+            STATS_ADD(decode_calls, 1);
+            value = self->handler->Result();
+            /* the next value starts from the root projection again */
+            self->handler->Reset();
+            if (value == NULL || PyList_Append(values, value) < 0) {
+                Py_XDECREF(value);
+                Py_DECREF(values);
+                Decoder_feed_reset(self);
+                return NULL;
             }
-            return pyjson;
+            Py_DECREF(value);
         }
     }
 
-    return doc2pyobj(doc);
+    /* keep only the unread part, and where its scan got to */
+    pending.erase(pending.begin(), pending.begin() + pos);
+    self->scanned = self->scanned > pos ? self->scanned - pos : 0;
+    return values;
+}
+
+static PyObject *
+Decoder_feed(DecoderObject *self, PyObject *chunk)
+{
+    TextBuffer buffer;
+    PyObject *ret;
+
+    if (!busy_enter((PyObject *)self, &self->busy)) {
+        PyErr_SetString(PyExc_RuntimeError, "Decoder is already in use");
+        return NULL;
+    }
+    if (!buffer.Get(chunk)) {
+        busy_leave((PyObject *)self, &self->busy);
+        return NULL;
+    }
+
+    self->pending->insert(self->pending->end(), buffer.data,
+                          buffer.data + buffer.length);
+    ret = Decoder_drain(self, false);
+    busy_leave((PyObject *)self, &self->busy);
+
+    return ret;
+}
+
+static PyObject *
+Decoder_close(DecoderObject *self, PyObject *args)
+{
+    PyObject *ret;
+
+    if (!busy_enter((PyObject *)self, &self->busy)) {
+        PyErr_SetString(PyExc_RuntimeError, "Decoder is already in use");
+        return NULL;
+    }
+
+    ret = Decoder_drain(self, true);
+    if (ret != NULL) {
+        Decoder_feed_reset(self);
+    }
+    busy_leave((PyObject *)self, &self->busy);
+
+    return ret;
+}
+
+static PyObject *
+Encoder_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"ensure_ascii", (char *)"max_retained", (char *)"default",
+                             (char *)"namedtuple_as_object", NULL};
+    PyObject *ensure_ascii = NULL;
+    PyObject *default_ = NULL;
+    PyObject *namedtuple_as_object = NULL;
+    Py_ssize_t max_retained = RETAINED_CAPACITY;
+    EncoderObject *self;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OnOO:Encoder", kwlist,
+                                     &ensure_ascii, &max_retained, &default_,
+                                     &namedtuple_as_object))
+        return NULL;
+
+    if (max_retained < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_retained must not be negative");
+        return NULL;
+    }
+
+    self = (EncoderObject *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        return NULL;
+    }
+    self->buffer = new rapidjson::StringBuffer();
+    if (ensure_ascii == NULL || PyObject_IsTrue(ensure_ascii)) {
+        self->ascii_writer = new rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, rapidjson::ASCII<> >(*self->buffer);
+    } else {
+        self->utf8_writer = new rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, rapidjson::UTF8<> >(*self->buffer);
+    }
+    if (default_ != NULL && default_ != Py_None) {
+        Py_INCREF(default_);
+        self->default_ = default_;
+    }
+    self->namedtuple_as_object = namedtuple_as_object != NULL && PyObject_IsTrue(namedtuple_as_object);
+    self->max_retained = (size_t)max_retained;
+    self->busy = false;
+
+    return (PyObject *)self;
+}
+
+static void
+Encoder_dealloc(EncoderObject *self)
+{
+    Py_XDECREF(self->default_);
+    delete self->ascii_writer;
+    delete self->utf8_writer;
+    delete self->buffer;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+template <typename Writer>
+static inline bool
+Encoder_write(EncoderObject *self, Writer& writer, PyObject *obj)
+{
+    EncodeOptions options;
+
+    options.namedtuple_as_object = self->namedtuple_as_object;
+    options.default_ = self->default_;
+    writer.Reset(*self->buffer);
+
+    STATS_START(timer);
+    bool ok = pyobj2writer(obj, writer, options);
+    STATS_STOP(encode_ns, timer);
+    STATS_ADD(encode_calls, 1);
+    STATS_ADD(bytes_out, self->buffer->GetSize());
+    return ok;
+}
+
+static PyObject *
+Encoder_encode(EncoderObject *self, PyObject *obj)
+{
+    PyObject *ret = NULL;
+    bool ok;
+
+    /* a __str__ of a dict key could call back into this encoder */
+    if (!busy_enter((PyObject *)self, &self->busy)) {
+        PyErr_SetString(PyExc_RuntimeError, "Encoder is already in use");
+        return NULL;
+    }
+
+    self->buffer->Clear();
+    if (self->ascii_writer) {
+        ok = Encoder_write(self, *self->ascii_writer, obj);
+    } else {
+        ok = Encoder_write(self, *self->utf8_writer, obj);
+    }
+    if (ok) {
+        ret = PyString_FromStringAndSize(self->buffer->GetString(),
+                                         self->buffer->GetSize());
+    }
+    if (self->buffer->GetSize() > self->max_retained) {
+        self->buffer->Clear();
+        self->buffer->ShrinkToFit();
+    }
+    busy_leave((PyObject *)self, &self->busy);
+
+    return ret;
 }
 
+static PyMethodDef Decoder_methods[] = {
+    {"decode", (PyCFunction)Decoder_decode, METH_O, Decoder_decode__doc__},
+    {"feed", (PyCFunction)Decoder_feed, METH_O, Decoder_feed__doc__},
+    {"close", (PyCFunction)Decoder_close, METH_NOARGS, Decoder_close__doc__},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
+static PyMethodDef Encoder_methods[] = {
+    {"encode", (PyCFunction)Encoder_encode, METH_O, Encoder_encode__doc__},
+    {NULL, NULL, 0, NULL} /* Sentinel */
+};
+
 static PyObject *
-pyrapidjson_loads(PyObject *self, PyObject *args, PyObject *kwargs)
+pyrapidjson_dumps(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    static char *kwlist[] = {(char *)"text", NULL};
-    char *text;
-    rapidjson::Document doc;
+    static char *kwlist[] = {(char *)"obj", (char *)"ensure_ascii", (char *)"sort_keys",
+                             (char *)"default", (char *)"namedtuple_as_object", NULL};
+    PyObject *pyjson;
+    PyObject *ensure_ascii = NULL;
+    PyObject *sort_keys = NULL;
+    PyObject *default_ = NULL;
+    PyObject *namedtuple_as_object = NULL;
+    EncodeOptions options;
 
     /* Parse arguments */
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s", kwlist, &text))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOOO", kwlist, &pyjson,
+                                     &ensure_ascii, &sort_keys, &default_,
+                                     &namedtuple_as_object))
         return NULL;
 
-    doc.Parse(text);
-    if (doc.HasParseError()) {
-        PyErr_SetString(PyExc_ValueError, GetParseError_En(doc.GetParseError()));
-        return NULL;
+    options.sort_keys = sort_keys != NULL && PyObject_IsTrue(sort_keys);
+    options.namedtuple_as_object = namedtuple_as_object != NULL && PyObject_IsTrue(namedtuple_as_object);
+    options.default_ = default_ != Py_None ? default_ : NULL;
+    if (ensure_ascii == NULL || PyObject_IsTrue(ensure_ascii)) {
+        return pyobj2pystring<rapidjson::ASCII<> >(pyjson, options);
     }
-
-    return _doc2pyobj(doc, text);
+    return pyobj2pystring<rapidjson::UTF8<> >(pyjson, options);
 }
 
+
 static PyObject *
-pyrapidjson_load(PyObject *self, PyObject *args, PyObject *kwargs)
+pyrapidjson_dump(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    static char *kwlist[] = {(char *)"text", NULL};
-    PyObject *py_file, *py_string, *read_method;
-    char *text;
-    rapidjson::Document doc;
+    static char *kwlist[] = {(char *)"obj", (char *)"fp", (char *)"chunk_size", (char *)"ensure_ascii",
+                             (char *)"sort_keys", (char *)"default", (char *)"namedtuple_as_object", NULL};
+    ModuleState *state = get_module_state(self);
+    PyObject *py_file, *py_json, *write_method;
+    PyObject *ensure_ascii = NULL;
+    PyObject *sort_keys = NULL;
+    PyObject *default_ = NULL;
+    PyObject *namedtuple_as_object = NULL;
+    Py_ssize_t chunk_size = DUMP_CHUNK_SIZE;
+    EncodeOptions options;
+    int fd, binary;
+    bool ok;
 
     /* Parse arguments */
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &py_file))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|nOOOO", kwlist,
+                                     &py_json, &py_file, &chunk_size,
+                                     &ensure_ascii, &sort_keys, &default_,
+                                     &namedtuple_as_object))
         return NULL;
+    options.sort_keys = sort_keys != NULL && PyObject_IsTrue(sort_keys);
+    options.namedtuple_as_object = namedtuple_as_object != NULL && PyObject_IsTrue(namedtuple_as_object);
+    options.default_ = default_ != Py_None ? default_ : NULL;
 
-    if (!PyObject_HasAttrString(py_file, "read")) {
-        PyErr_Format(PyExc_TypeError, "expected file object. has not read() method.");
+    if (chunk_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
         return NULL;
     }
-    read_method = PyObject_GetAttrString(py_file, "read");
-    if (!PyCallable_Check(read_method)) {
-        Py_XDECREF(read_method);
-        PyErr_Format(PyExc_TypeError, "expected file object. read() method is not callable.");
+
+    if (!PyObject_HasAttrString(py_file, "write")) {
+        PyErr_Format(PyExc_TypeError, "expected file object. has not write() method.");
+        return NULL;
+    }
+    write_method = PyObject_GetAttrString(py_file, "write");
+    if (!PyCallable_Check(write_method)) {
+        Py_XDECREF(write_method);
+        PyErr_Format(PyExc_TypeError, "expected file object. write() method is not callable.");
         return NULL;
     }
 
-    py_string = PyObject_CallObject(read_method, NULL);
-    if (py_string == NULL) {
-        Py_XDECREF(read_method);
+    if ((fd = raw_file_descriptor(state, py_file)) == -2 ||
+        (binary = is_binary_file(state, py_file)) < 0) {
+        Py_XDECREF(write_method);
         return NULL;
     }
 
-#ifdef PY3
-    PyObject *utf8_item;
-    utf8_item = PyUnicode_AsUTF8String(py_string);
-    text = PyBytes_AsString(utf8_item);
-#else
-    text = PyString_AsString(py_string);
-#endif
-    doc.Parse(text);
+    PyFileWriteStream os(write_method, fd, binary, (size_t)chunk_size);
+    STATS_START(timer);
+    if (ensure_ascii == NULL || PyObject_IsTrue(ensure_ascii)) {
+        rapidjson::Writer<PyFileWriteStream, rapidjson::UTF8<>, rapidjson::ASCII<> > writer(os);
+        ok = pyobj2writer(py_json, writer, options);
+    } else {
+        rapidjson::Writer<PyFileWriteStream, rapidjson::UTF8<>, rapidjson::UTF8<> > writer(os);
+        ok = pyobj2writer(py_json, writer, options);
+    }
+    if (ok) {
+        os.Flush();
+    }
+    STATS_STOP(encode_ns, timer);
+    STATS_ADD(encode_calls, 1);
+    STATS_ADD(bytes_out, os.Tell());
 
-    if (doc.HasParseError()) {
-        Py_XDECREF(read_method);
-        Py_XDECREF(py_string);
-        PyErr_SetString(PyExc_ValueError, GetParseError_En(doc.GetParseError()));
+    Py_XDECREF(write_method);
+    if (!ok || os.Failed()) {
         return NULL;
     }
 
-    Py_XDECREF(read_method);
-    Py_XDECREF(py_string);
+    Py_RETURN_NONE;
+}
 
-    PyObject *ret = _doc2pyobj(doc, text);
-#ifdef PY3
-    Py_XDECREF(utf8_item);
-#endif
+/*
+ * A new hash object for fingerprint(): xxhash.xxh3_64() for "xxh3",
+ * hashlib.new(algo) otherwise. The module is imported once per module
+ * object; should two threads race to import it, the first one is kept.
+ */
+static PyObject *
+new_hasher(PyObject *module, const char *algo)
+{
+    ModuleState *state = get_module_state(module);
+    bool xxh3 = strcmp(algo, "xxh3") == 0;
+    PyObject **slot = xxh3 ? &state->xxhash : &state->hashlib;
+    PyObject *lib, *hasher;
+
+    Py_BEGIN_CRITICAL_SECTION(module);
+    lib = *slot;
+    Py_XINCREF(lib);
+    Py_END_CRITICAL_SECTION();
+    if (lib == NULL) {
+        if ((lib = PyImport_ImportModule(xxh3 ? "xxhash" : "hashlib")) == NULL) {
+            return NULL;
+        }
+        Py_BEGIN_CRITICAL_SECTION(module);
+        if (*slot == NULL) {
+            Py_INCREF(lib);
+            *slot = lib;
+        }
+        Py_END_CRITICAL_SECTION();
+    }
+
+    if (xxh3) {
+        hasher = PyObject_CallMethod(lib, (char *)"xxh3_64", NULL);
+    } else {
+        hasher = PyObject_CallMethod(lib, (char *)"new", (char *)"s", algo);
+    }
+    Py_DECREF(lib);
+    return hasher;
+}
+
+/*
+ * fingerprint(): the canonical encoding goes through a PyFileWriteStream
+ * straight into the hash object's update(), DUMP_CHUNK_SIZE bytes at a
+ * time, so the text is never held in full.
+ */
+static PyObject *
+pyrapidjson_fingerprint(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {(char *)"obj", (char *)"algo", (char *)"default",
+                             (char *)"namedtuple_as_object", NULL};
+    PyObject *obj, *hasher, *update;
+    PyObject *default_ = NULL;
+    PyObject *namedtuple_as_object = NULL;
+    PyObject *ret = NULL;
+    const char *algo = "sha256";
+    EncodeOptions options;
+    bool ok;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|sOO", kwlist, &obj, &algo, &default_,
+                                     &namedtuple_as_object))
+        return NULL;
+    options.namedtuple_as_object = namedtuple_as_object != NULL && PyObject_IsTrue(namedtuple_as_object);
+    options.default_ = default_ != Py_None ? default_ : NULL;
+
+    if ((hasher = new_hasher(self, algo)) == NULL) {
+        return NULL;
+    }
+    if ((update = PyObject_GetAttrString(hasher, "update")) == NULL) {
+        Py_DECREF(hasher);
+        return NULL;
+    }
+
+    options.sort_keys = true;
+    options.canonical = true;
+    PyFileWriteStream os(update, -1, true, DUMP_CHUNK_SIZE);
+    rapidjson::Writer<PyFileWriteStream, rapidjson::UTF8<>, rapidjson::UTF8<> > writer(os);
+    STATS_START(timer);
+    ok = pyobj2writer(obj, writer, options);
+    if (ok) {
+        os.Flush();
+    }
+    STATS_STOP(encode_ns, timer);
+    STATS_ADD(encode_calls, 1);
+
+    if (ok && !os.Failed()) {
+        ret = PyObject_CallMethod(hasher, (char *)"hexdigest", NULL);
+    }
+    Py_DECREF(update);
+    Py_DECREF(hasher);
     return ret;
 }
 
+/*
+ * dump_iter(): encodes the items of an iterable as they are pulled from it
+ * and hands the output out in chunks, so a generator or a cursor never has
+ * to be materialized and the first bytes are ready before the last item
+ * is read.
+ */
+typedef struct {
+    PyObject_HEAD
+    PyObject *iter;                 /* NULL once exhausted or failed */
+    rapidjson::StringBuffer *buffer;
+    /* exactly one of the two, as chosen by ensure_ascii */
+    rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, rapidjson::ASCII<> > *ascii_writer;
+    rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, rapidjson::UTF8<> > *utf8_writer;
+    PyObject *default_;             /* NULL for none */
+    bool namedtuple_as_object;
+    size_t chunk_size;
+    bool ndjson;
+    bool started;                   /* an item (or "[") has been written */
+    bool busy;
+} DumpIterObject;
+
+static PyTypeObject DumpIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "rapidjson.DumpIter",           /* tp_name */
+    sizeof(DumpIterObject),         /* tp_basicsize */
+};
+
+static int
+DumpIter_traverse(DumpIterObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->iter);
+    Py_VISIT(self->default_);
+    return 0;
+}
+
+static int
+DumpIter_clear(DumpIterObject *self)
+{
+    Py_CLEAR(self->iter);
+    Py_CLEAR(self->default_);
+    return 0;
+}
+
+static void
+DumpIter_dealloc(DumpIterObject *self)
+{
+    PyObject_GC_UnTrack(self);
+    DumpIter_clear(self);
+    delete self->ascii_writer;
+    delete self->utf8_writer;
+    delete self->buffer;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+template <typename Writer>
+static inline bool
+DumpIter_write(DumpIterObject *self, Writer& writer, PyObject *obj)
+{
+    EncodeOptions options;
+
+    options.namedtuple_as_object = self->namedtuple_as_object;
+    options.default_ = self->default_;
+    writer.Reset(*self->buffer);
+
+    STATS_START(timer);
+    bool ok = pyobj2writer(obj, writer, options);
+    STATS_STOP(encode_ns, timer);
+    STATS_ADD(encode_calls, 1);
+    return ok;
+}
+
+/* encode items until chunk_size bytes are buffered or the iterable ends */
+static bool
+DumpIter_fill(DumpIterObject *self)
+{
+    rapidjson::StringBuffer& buffer = *self->buffer;
+    PyObject *item;
+    bool ok;
+
+    while (buffer.GetSize() < self->chunk_size) {
+        item = PyIter_Next(self->iter);
+        if (item == NULL) {
+            if (PyErr_Occurred()) {
+                return false;
+            }
+            if (!self->ndjson) {
+                if (!self->started) {
+                    buffer.Put('[');
+                }
+                buffer.Put(']');
+            }
+            Py_CLEAR(self->iter);
+            return true;
+        }
+        if (!self->ndjson) {
+            buffer.Put(self->started ? ',' : '[');
+        }
+        self->started = true;
+        if (self->ascii_writer) {
+            ok = DumpIter_write(self, *self->ascii_writer, item);
+        } else {
+            ok = DumpIter_write(self, *self->utf8_writer, item);
+        }
+        Py_DECREF(item);
+        if (!ok) {
+            return false;
+        }
+        if (self->ndjson) {
+            buffer.Put('\n');
+        }
+    }
+    return true;
+}
 
 static PyObject *
-pyrapidjson_dumps(PyObject *self, PyObject *args, PyObject *kwargs)
+DumpIter_iternext(DumpIterObject *self)
 {
-    static char *kwlist[] = {(char *)"obj", NULL};
-    PyObject *pyjson;
+    PyObject *chunk = NULL;
+    PyObject *iter = NULL;
+    size_t size;
 
-    /* Parse arguments */
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &pyjson))
+    /* the iterable, or a __str__ of a dict key, could call back into this */
+    if (!busy_enter((PyObject *)self, &self->busy)) {
+        PyErr_SetString(PyExc_RuntimeError, "dump_iter is already in use");
         return NULL;
+    }
 
-    return pyobj2pystring(pyjson);
+    if (self->iter == NULL) {
+        /* exhausted */
+    } else if (!DumpIter_fill(self)) {
+        iter = self->iter;
+        self->iter = NULL;
+        self->buffer->Clear();
+    } else if (self->buffer->GetSize() > 0) {
+        chunk = PyBytes_FromStringAndSize(self->buffer->GetString(),
+                                          (Py_ssize_t)self->buffer->GetSize());
+        /* a single large item may have grown the buffer well past a chunk */
+        size = self->buffer->GetSize();
+        STATS_ADD(bytes_out, size);
+        self->buffer->Clear();
+        if (size > 2 * self->chunk_size) {
+            self->buffer->ShrinkToFit();
+        }
+    }
+    busy_leave((PyObject *)self, &self->busy);
+    Py_XDECREF(iter);
+    return chunk;
 }
 
-
 static PyObject *
-pyrapidjson_dump(PyObject *self, PyObject *args, PyObject *kwargs)
+pyrapidjson_dump_iter(PyObject *self, PyObject *args, PyObject *kwargs)
 {
-    // TODO: not support kwargs like json.dump() (encoding, etc...)
-    static char *kwlist[] = {(char *)"obj", (char *)"fp", NULL};
-    PyObject *py_file, *py_json, *py_string, *write_method, *write_arg, *write_ret;
-    rapidjson::Document doc;
+    static char *kwlist[] = {(char *)"iterable", (char *)"chunk_size", (char *)"format", (char *)"ensure_ascii",
+                             (char *)"default", (char *)"namedtuple_as_object", NULL};
+    PyObject *iterable;
+    PyObject *ensure_ascii = NULL;
+    PyObject *default_ = NULL;
+    PyObject *namedtuple_as_object = NULL;
+    Py_ssize_t chunk_size = DUMP_CHUNK_SIZE;
+    const char *format = "array";
+    DumpIterObject *iter;
+    bool ndjson;
 
     /* Parse arguments */
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO", kwlist, &py_json, &py_file))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|nsOOO", kwlist,
+                                     &iterable, &chunk_size, &format,
+                                     &ensure_ascii, &default_, &namedtuple_as_object))
         return NULL;
 
-    if (!PyObject_HasAttrString(py_file, "write")) {
-        PyErr_Format(PyExc_TypeError, "expected file object. has not write() method.");
+    if (chunk_size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "chunk_size must be positive");
         return NULL;
     }
-    write_method = PyObject_GetAttrString(py_file, "write");
-    if (!PyCallable_Check(write_method)) {
-        Py_XDECREF(write_method);
-        PyErr_Format(PyExc_TypeError, "expected file object. write() method is not callable.");
+    if (strcmp(format, "ndjson") == 0) {
+        ndjson = true;
+    } else if (strcmp(format, "array") == 0) {
+        ndjson = false;
+    } else {
+        PyErr_Format(PyExc_ValueError,
+                     "format must be 'array' or 'ndjson', not '%.100s'", format);
         return NULL;
     }
 
-    py_string = pyobj2pystring(py_json);
-    if (py_string == NULL) {
-        Py_XDECREF(write_method);
-        PyErr_SetString(PyExc_RuntimeError, "pyobj2pystring() error.");
+    iter = PyObject_GC_New(DumpIterObject, &DumpIterType);
+    if (iter == NULL) {
         return NULL;
     }
-
-    write_arg = PyTuple_Pack(1, py_string);
-    if (write_arg == NULL) {
-        Py_XDECREF(write_method);
+    iter->buffer = new rapidjson::StringBuffer();
+    iter->ascii_writer = NULL;
+    iter->utf8_writer = NULL;
+    iter->default_ = NULL;
+    if (default_ != NULL && default_ != Py_None) {
+        Py_INCREF(default_);
+        iter->default_ = default_;
+    }
+    iter->namedtuple_as_object = namedtuple_as_object != NULL && PyObject_IsTrue(namedtuple_as_object);
+    if (ensure_ascii == NULL || PyObject_IsTrue(ensure_ascii)) {
+        iter->ascii_writer = new rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, rapidjson::ASCII<> >(*iter->buffer);
+    } else {
+        iter->utf8_writer = new rapidjson::Writer<rapidjson::StringBuffer, rapidjson::UTF8<>, rapidjson::UTF8<> >(*iter->buffer);
+    }
+    iter->chunk_size = (size_t)chunk_size;
+    iter->ndjson = ndjson;
+    iter->started = false;
+    iter->busy = false;
+    iter->iter = PyObject_GetIter(iterable);
+    PyObject_GC_Track(iter);
+    if (iter->iter == NULL) {
+        Py_DECREF(iter);
         return NULL;
     }
 
-    write_ret = PyObject_CallObject(write_method, write_arg);
-    if (write_ret == NULL) {
-        Py_XDECREF(write_method);
-        Py_XDECREF(write_arg);
-        Py_XDECREF(py_string);
+    return (PyObject *)iter;
+}
+
+static PyObject *
+pyrapidjson_cache_info(PyObject *self, PyObject *args)
+{
+    PyInterpreterState *interp = current_interpreter();
+    Py_ssize_t hits = 0, misses = 0, size = 0;
+
+    for (size_t i = 0; i < KEY_CACHE_SIZE; ++i) {
+        KeyCacheEntry& entry = key_cache[i];
+
+        KEY_CACHE_LOCK(entry);
+        if (entry.interp == interp) {
+            hits += entry.hits;
+            misses += entry.misses;
+            if (entry.str) {
+                size++;
+            }
+        }
+        KEY_CACHE_UNLOCK(entry);
+    }
+    return Py_BuildValue("{s:n,s:n,s:n,s:n}",
+                         "hits", hits,
+                         "misses", misses,
+                         "size", size,
+                         "maxsize", (Py_ssize_t)KEY_CACHE_SIZE);
+}
+
+
+static PyObject *
+pyrapidjson_stats(PyObject *self, PyObject *args)
+{
+#ifdef PYRAPIDJSON_STATS
+    Stats snapshot;
+
+    STATS_LOCK();
+    snapshot = stats;
+    STATS_UNLOCK();
+    return Py_BuildValue("{s:O,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+                         "enabled", Py_True,
+                         "decode_calls", (unsigned PY_LONG_LONG)snapshot.decode_calls,
+                         "encode_calls", (unsigned PY_LONG_LONG)snapshot.encode_calls,
+                         "decode_ns", (unsigned PY_LONG_LONG)snapshot.decode_ns,
+                         "parse_ns", (unsigned PY_LONG_LONG)snapshot.parse_ns,
+                         "convert_ns", (unsigned PY_LONG_LONG)snapshot.convert_ns,
+                         "encode_ns", (unsigned PY_LONG_LONG)snapshot.encode_ns,
+                         "bytes_in", (unsigned PY_LONG_LONG)snapshot.bytes_in,
+                         "bytes_out", (unsigned PY_LONG_LONG)snapshot.bytes_out,
+                         "allocator_bytes", (unsigned PY_LONG_LONG)snapshot.allocator_bytes,
+                         "max_depth", (unsigned PY_LONG_LONG)snapshot.max_depth);
+#else
+    return Py_BuildValue("{s:O}", "enabled", Py_False);
+#endif
+}
+
+static PyObject *
+pyrapidjson_reset_stats(PyObject *self, PyObject *args)
+{
+#ifdef PYRAPIDJSON_STATS
+    STATS_LOCK();
+    memset(&stats, 0, sizeof(stats));
+    STATS_UNLOCK();
+#endif
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+pyrapidjson_build_info(PyObject *self, PyObject *args)
+{
+    /* rapidjson's own SIMD code paths compiled into this variant */
+    static const char *simd[] = {
+#ifdef RAPIDJSON_SSE2
+        "sse2",
+#endif
+#ifdef RAPIDJSON_SSE42
+        "sse4.2",
+#endif
+#ifdef RAPIDJSON_NEON
+        "neon",
+#endif
+        NULL
+    };
+    PyObject *paths, *info;
+    Py_ssize_t i, n = 0;
+
+    while (simd[n] != NULL) {
+        n++;
+    }
+    paths = PyTuple_New(n);
+    if (paths == NULL) {
         return NULL;
     }
+    for (i = 0; i < n; ++i) {
+        PyObject *name = Py_BuildValue("s", simd[i]);
+        if (name == NULL) {
+            Py_DECREF(paths);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(paths, i, name);
+    }
 
-    Py_XDECREF(write_method);
-    Py_XDECREF(write_arg);
-    Py_XDECREF(write_ret);
-    Py_XDECREF(py_string);
+    info = Py_BuildValue("{s:s,s:O,s:s,s:s,s:O,s:O}",
+                         "variant", PYRAPIDJSON_VARIANT_NAME,
+                         "simd", paths,
+#if defined(__AVX2__)
+                         "ascii_scan", "avx2",
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+                         "ascii_scan", "sse2",
+#else
+                         "ascii_scan", "scalar",
+#endif
+                         "rapidjson", RAPIDJSON_VERSION_STRING,
+                         "stats", STATS_ENABLED ? Py_True : Py_False,
+#ifdef Py_GIL_DISABLED
+                         "free_threaded", Py_True);
+#else
+                         "free_threaded", Py_False);
+#endif
+    Py_DECREF(paths);
+    return info;
+}
 
+static PyObject *
+pyrapidjson_cache_clear(PyObject *self, PyObject *args)
+{
+    key_cache_clear(current_interpreter());
     Py_RETURN_NONE;
 }
 
@@ -677,39 +5309,239 @@ static PyMethodDef PyrapidjsonMethods[] = {
      pyrapidjson_loads__doc__},
     {"load", (PyCFunction)pyrapidjson_load, METH_VARARGS | METH_KEYWORDS,
      pyrapidjson_load__doc__},
+    {"iterload", (PyCFunction)pyrapidjson_iterload, METH_VARARGS | METH_KEYWORDS,
+     pyrapidjson_iterload__doc__},
+    {"load_path", (PyCFunction)pyrapidjson_load_path, METH_VARARGS | METH_KEYWORDS,
+     pyrapidjson_load_path__doc__},
+    {"loads_many", (PyCFunction)pyrapidjson_loads_many, METH_VARARGS | METH_KEYWORDS,
+     pyrapidjson_loads_many__doc__},
+    {"loads_columns", (PyCFunction)pyrapidjson_loads_columns, METH_VARARGS | METH_KEYWORDS,
+     pyrapidjson_loads_columns__doc__},
     {"dumps", (PyCFunction)pyrapidjson_dumps, METH_VARARGS | METH_KEYWORDS,
      pyrapidjson_dumps__doc__},
     {"dump", (PyCFunction)pyrapidjson_dump, METH_VARARGS | METH_KEYWORDS,
      pyrapidjson_dump__doc__},
+    {"dump_iter", (PyCFunction)pyrapidjson_dump_iter, METH_VARARGS | METH_KEYWORDS,
+     pyrapidjson_dump_iter__doc__},
+    {"fingerprint", (PyCFunction)pyrapidjson_fingerprint, METH_VARARGS | METH_KEYWORDS,
+     pyrapidjson_fingerprint__doc__},
+    {"cache_info", (PyCFunction)pyrapidjson_cache_info, METH_NOARGS,
+     pyrapidjson_cache_info__doc__},
+    {"cache_clear", (PyCFunction)pyrapidjson_cache_clear, METH_NOARGS,
+     pyrapidjson_cache_clear__doc__},
+    {"stats", (PyCFunction)pyrapidjson_stats, METH_NOARGS,
+     pyrapidjson_stats__doc__},
+    {"reset_stats", (PyCFunction)pyrapidjson_reset_stats, METH_NOARGS,
+     pyrapidjson_reset_stats__doc__},
+    {"build_info", (PyCFunction)pyrapidjson_build_info, METH_NOARGS,
+     pyrapidjson_build_info__doc__},
     {NULL, NULL, 0, NULL} /* Sentinel */
 };
 
+/* fill in and ready the static types, once for all module objects */
+static bool
+ready_types(void)
+{
+    static bool ready = false;
+
+    if (ready) {
+        return true;
+    }
+
+    IterLoaderType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
+    IterLoaderType.tp_dealloc = (destructor)IterLoader_dealloc;
+    IterLoaderType.tp_traverse = (traverseproc)IterLoader_traverse;
+    IterLoaderType.tp_clear = (inquiry)IterLoader_clear;
+    IterLoaderType.tp_free = PyObject_GC_Del;
+    IterLoaderType.tp_iter = PyObject_SelfIter;
+    IterLoaderType.tp_iternext = (iternextfunc)IterLoader_iternext;
+    if (PyType_Ready(&IterLoaderType) < 0)
+        return false;
+
+    DumpIterType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
+    DumpIterType.tp_dealloc = (destructor)DumpIter_dealloc;
+    DumpIterType.tp_traverse = (traverseproc)DumpIter_traverse;
+    DumpIterType.tp_clear = (inquiry)DumpIter_clear;
+    DumpIterType.tp_free = PyObject_GC_Del;
+    DumpIterType.tp_iter = PyObject_SelfIter;
+    DumpIterType.tp_iternext = (iternextfunc)DumpIter_iternext;
+    if (PyType_Ready(&DumpIterType) < 0)
+        return false;
+
+    ColumnBuffer_as_buffer.bf_getbuffer = (getbufferproc)ColumnBuffer_getbuffer;
+    ColumnBufferType.tp_flags = Py_TPFLAGS_DEFAULT;
+#ifndef PY3
+    ColumnBufferType.tp_flags |= Py_TPFLAGS_HAVE_NEWBUFFER;
+#endif
+    ColumnBufferType.tp_dealloc = (destructor)ColumnBuffer_dealloc;
+    ColumnBufferType.tp_as_buffer = &ColumnBuffer_as_buffer;
+    if (PyType_Ready(&ColumnBufferType) < 0)
+        return false;
+
+    DocumentType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC;
+    DocumentType.tp_doc = Document__doc__;
+    DocumentType.tp_new = Document_new;
+    DocumentType.tp_dealloc = (destructor)Document_dealloc;
+    DocumentType.tp_traverse = (traverseproc)Document_traverse;
+    DocumentType.tp_clear = (inquiry)Document_clear;
+    DocumentType.tp_free = PyObject_GC_Del;
+    DocumentType.tp_as_mapping = &Document_as_mapping;
+    DocumentType.tp_as_sequence = &Document_as_sequence;
+    DocumentType.tp_iter = (getiterfunc)Document_iter;
+    DocumentType.tp_methods = Document_methods;
+    if (PyType_Ready(&DocumentType) < 0)
+        return false;
+
+    DecoderType.tp_flags = Py_TPFLAGS_DEFAULT;
+    DecoderType.tp_doc = Decoder__doc__;
+    DecoderType.tp_new = Decoder_new;
+    DecoderType.tp_dealloc = (destructor)Decoder_dealloc;
+    DecoderType.tp_methods = Decoder_methods;
+    if (PyType_Ready(&DecoderType) < 0)
+        return false;
+
+    EncoderType.tp_flags = Py_TPFLAGS_DEFAULT;
+    EncoderType.tp_doc = Encoder__doc__;
+    EncoderType.tp_new = Encoder_new;
+    EncoderType.tp_dealloc = (destructor)Encoder_dealloc;
+    EncoderType.tp_methods = Encoder_methods;
+    if (PyType_Ready(&EncoderType) < 0)
+        return false;
+
+    SchemaType.tp_flags = Py_TPFLAGS_DEFAULT;
+    SchemaType.tp_doc = Schema__doc__;
+    SchemaType.tp_new = Schema_new;
+    SchemaType.tp_dealloc = (destructor)Schema_dealloc;
+    SchemaType.tp_methods = Schema_methods;
+    if (PyType_Ready(&SchemaType) < 0)
+        return false;
+
+    ValidationErrorType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE;
+    ValidationErrorType.tp_doc = ValidationError__doc__;
+    ValidationErrorType.tp_base = (PyTypeObject *)PyExc_ValueError;
+    if (PyType_Ready(&ValidationErrorType) < 0)
+        return false;
+
+    ready = true;
+    return true;
+}
+
+static bool
+add_type(PyObject *module, const char *name, PyTypeObject *type)
+{
+    Py_INCREF(type);
+    if (PyModule_AddObject(module, name, (PyObject *)type) < 0) {
+        Py_DECREF(type);
+        return false;
+    }
+    return true;
+}
+
+static int
+pyrapidjson_exec(PyObject *module)
+{
+    if (!ready_types() ||
+        !load_io_types(get_module_state(module)) ||
+        !add_type(module, "Document", &DocumentType) ||
+        !add_type(module, "Decoder", &DecoderType) ||
+        !add_type(module, "Encoder", &EncoderType) ||
+        !add_type(module, "Schema", &SchemaType) ||
+        !add_type(module, "ValidationError", &ValidationErrorType)) {
+        return -1;
+    }
+    return 0;
+}
+
 #ifdef PY3
+static int
+pyrapidjson_traverse(PyObject *module, visitproc visit, void *arg)
+{
+    ModuleState *state = get_module_state(module);
+
+    Py_VISIT(state->io_FileIO);
+    Py_VISIT(state->io_binary_types);
+    Py_VISIT(state->hashlib);
+    Py_VISIT(state->xxhash);
+    return 0;
+}
+
+static int
+pyrapidjson_clear(PyObject *module)
+{
+    ModuleState *state = get_module_state(module);
+
+    Py_CLEAR(state->io_FileIO);
+    Py_CLEAR(state->io_binary_types);
+    Py_CLEAR(state->hashlib);
+    Py_CLEAR(state->xxhash);
+    return 0;
+}
+
+/* the module goes away with its interpreter, and so do its cached keys */
+static void
+pyrapidjson_free(void *module)
+{
+    pyrapidjson_clear((PyObject *)module);
+    key_cache_clear(current_interpreter());
+}
+
+#ifdef PYRAPIDJSON_MULTI_PHASE_INIT
+/*
+ * The static types are shared by all interpreters, so the module can be
+ * imported by subinterpreters that share the main GIL, but not by ones
+ * with a GIL of their own. Free-threaded builds keep the GIL off.
+ */
+static PyModuleDef_Slot pyrapidjson_slots[] = {
+    {Py_mod_exec, (void *)pyrapidjson_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    {Py_mod_multiple_interpreters, Py_MOD_MULTIPLE_INTERPRETERS_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+#endif
+
 static struct PyModuleDef pyrapidjson_module_def = {
     PyModuleDef_HEAD_INIT,
-    "rapidjson",
+    PYRAPIDJSON_MODULE_NAME,
     pyrapidjson__doc__,
-    -1,
+    sizeof(ModuleState),
     PyrapidjsonMethods,
+#ifdef PYRAPIDJSON_MULTI_PHASE_INIT
+    pyrapidjson_slots,
+#else
+    NULL,
+#endif
+    pyrapidjson_traverse,
+    pyrapidjson_clear,
+    pyrapidjson_free,
 };
 
 PyMODINIT_FUNC
-PyInit_rapidjson(void)
+PYRAPIDJSON_MODULE_INIT(PyInit_)(void)
+{
+#ifdef PYRAPIDJSON_MULTI_PHASE_INIT
+    return PyModuleDef_Init(&pyrapidjson_module_def);
 #else
+    PyObject *module = PyModule_Create(&pyrapidjson_module_def);
 
-PyMODINIT_FUNC
-initrapidjson(void)
+    if (module != NULL && pyrapidjson_exec(module) < 0) {
+        Py_CLEAR(module);
+    }
+    return module;
 #endif
+}
+#else
+PyMODINIT_FUNC
+PYRAPIDJSON_MODULE_INIT(init)(void)
 {
     PyObject *module;
 
-#ifdef PY3
-    module = PyModule_Create(&pyrapidjson_module_def);
-    return module;
-#else
-    /* The module */
-    module = Py_InitModule3("rapidjson", PyrapidjsonMethods, pyrapidjson__doc__);
-    if (module == NULL)
-        return;
-#endif
+    module = Py_InitModule3(PYRAPIDJSON_MODULE_NAME, PyrapidjsonMethods, pyrapidjson__doc__);
+    if (module != NULL) {
+        pyrapidjson_exec(module);
+    }
 }
+#endif
@@ -0,0 +1,55 @@
+"""Python binding for rapidjson
+
+The extension is built once per instruction set (see setup.py) and the
+best variant this CPU supports is imported here. Set PYRAPIDJSON_VARIANT
+to baseline, sse42 or avx2 to force one.
+"""
+import os
+
+# best first
+VARIANTS = ('avx2', 'sse42', 'baseline')
+
+
+def _supported_variants():
+    try:
+        from _rapidjson_cpu import cpu_features
+    except ImportError:
+        return ['baseline']
+    features = cpu_features()
+    return [v for v in VARIANTS if v == 'baseline' or features.get(v)]
+
+
+def _import_variant(forced):
+    supported = _supported_variants()
+    if forced:
+        if forced not in VARIANTS:
+            raise ImportError("unknown PYRAPIDJSON_VARIANT %r, expected one of %s"
+                              % (forced, ", ".join(VARIANTS)))
+        if forced not in supported:
+            raise ImportError("PYRAPIDJSON_VARIANT=%s is not supported by this CPU"
+                              % forced)
+        return __import__('_rapidjson_' + forced), supported
+    for variant in supported:
+        try:
+            return __import__('_rapidjson_' + variant), supported
+        except ImportError:
+            # not built for this platform
+            continue
+    raise ImportError("no rapidjson extension variant is installed")
+
+
+_forced = os.environ.get('PYRAPIDJSON_VARIANT')
+_impl, _supported = _import_variant(_forced)
+for _name in dir(_impl):
+    if not _name.startswith('_'):
+        globals()[_name] = getattr(_impl, _name)
+del _name
+
+
+def build_info():
+    """Return the active variant, its SIMD code paths, the variants this
+    CPU supports and the rapidjson version"""
+    info = _impl.build_info()
+    info['supported'] = list(_supported)
+    info['forced'] = bool(_forced)
+    return info
@@ -0,0 +1,3 @@
+/* the AVX2 build of the extension; see setup.py */
+#define PYRAPIDJSON_VARIANT avx2
+#include "../_pyrapidjson.cpp"
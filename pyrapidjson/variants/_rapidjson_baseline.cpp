@@ -0,0 +1,3 @@
+/* the baseline build of the extension, for any CPU; see setup.py */
+#define PYRAPIDJSON_VARIANT baseline
+#include "../_pyrapidjson.cpp"
@@ -0,0 +1,3 @@
+/* the SSE4.2 build of the extension; see setup.py */
+#define PYRAPIDJSON_VARIANT sse42
+#include "../_pyrapidjson.cpp"
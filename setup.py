@@ -1,5 +1,45 @@
+import os
+import platform
+import sys
 from distutils.core import setup, Extension
 
+# rapidjson is the git submodule at pyrapidjson/rapidjson ("make setup"
+# checks it out). It must be newer than the 1.1.0 release, which lacks
+# Reader::IterativeParseInit()/Next()/Complete().
+rapidjson_include = os.path.join('pyrapidjson', 'rapidjson', 'include')
+if not os.path.exists(os.path.join(rapidjson_include, 'rapidjson', 'reader.h')):
+    sys.exit("rapidjson not found in %s; run 'make setup' first" % rapidjson_include)
+
+define_macros = []
+if os.environ.get('PYRAPIDJSON_STATS'):
+    # collect the counters returned by rapidjson.stats()
+    define_macros.append(('PYRAPIDJSON_STATS', '1'))
+
+# _pyrapidjson.cpp is built once per instruction set (through the wrappers
+# in pyrapidjson/variants/); rapidjson.py imports the best one the CPU
+# supports, as told by pyrapidjson/_cpu.cpp.
+machine = platform.machine().lower()
+is_x86_64 = machine in ('x86_64', 'amd64')
+is_x86 = is_x86_64 or machine in ('i386', 'i686', 'x86')
+is_msvc = sys.platform == 'win32'
+variants = [('baseline', [('RAPIDJSON_SSE2', '1')] if is_x86_64 else [], [])]
+if is_x86:
+    variants.append(('sse42', [('RAPIDJSON_SSE42', '1')],
+                     [] if is_msvc else ['-msse4.2']))
+    variants.append(('avx2', [('RAPIDJSON_SSE42', '1')],
+                     ['/arch:AVX2'] if is_msvc else ['-mavx2']))
+
+ext_modules = [Extension('_rapidjson_cpu', sources=['pyrapidjson/_cpu.cpp'])]
+for variant, macros, flags in variants:
+    ext_modules.append(
+        Extension('_rapidjson_' + variant,
+                  sources=['pyrapidjson/variants/_rapidjson_%s.cpp' % variant],
+                  depends=['pyrapidjson/_pyrapidjson.cpp'],
+                  include_dirs=[rapidjson_include],
+                  define_macros=define_macros + macros,
+                  extra_compile_args=flags,
+                  #extra_compile_args=["-DDEBUG"],
+                  ))
 
 setup(
     name='pyrapidjson',
@@ -21,10 +61,7 @@ setup(
         'Programming Language :: Python :: 3',
     ],
     keywords='json rapidjson',
-    ext_modules=[
-        Extension('rapidjson',
-                  sources=['pyrapidjson/_pyrapidjson.cpp'],
-                  include_dirs=['./pyrapidjson/rapidjson/include/'],
-                  #extra_compile_args=["-DDEBUG"],
-                  )]
+    package_dir={'': 'pyrapidjson'},
+    py_modules=['rapidjson'],
+    ext_modules=ext_modules,
 )
@@ -1,7 +1,13 @@
 # coding: utf-8
 import sys
 import os
+import subprocess
+import io
+import hashlib
 import json
+import gc
+import threading
+import weakref
 import unittest
 from tempfile import NamedTemporaryFile
 import rapidjson
@@ -108,6 +114,121 @@ class TestDecodeComplex(unittest.TestCase):
         ret = rapidjson.loads(text)
         self.assertEqual(ret, {u"は": u"bc"})
 
+    def test_empty_containers(self):
+        text = """{"a": [], "b": {}, "c": [[], {}]}"""
+        ret = rapidjson.loads(text)
+        self.assertEqual(ret, {"a": [], "b": {}, "c": [[], {}]})
+
+    def test_list_of_dicts(self):
+        text = """[{"id": 1, "v": [true, null]}, {"id": 2, "v": []}]"""
+        ret = rapidjson.loads(text)
+        self.assertEqual(ret, [{"id": 1, "v": [True, None]},
+                               {"id": 2, "v": []}])
+
+    def test_large_integer(self):
+        text = "[9223372036854775807, 18446744073709551615, -9223372036854775808]"
+        ret = rapidjson.loads(text)
+        self.assertEqual(ret, [9223372036854775807, 18446744073709551615,
+                               -9223372036854775808])
+
+
+class TestDecodeUnicode(unittest.TestCase):
+
+    strings = [u"", u"a", u"ascii only " * 10, u"caf\xe9", u"\xff" * 40,
+               u"x" * 37 + u"\u3042", u"\u3053\u3093\u306b\u3061\u306f" * 9,
+               u"\U0001f600", u"a\xe9\u3042\U0001f600" * 17, u"nul\x00byte",
+               u"\u0100", u"\u07ff\u0800\uffff\U00010000\U0010ffff"]
+
+    def test_string_kinds(self):
+        for s in self.strings:
+            text = json.dumps([s, {s: s}], ensure_ascii=False)
+            self.assertEqual([s, {s: s}], rapidjson.loads(text))
+            self.assertEqual([s], rapidjson.loads(b'[' + json.dumps(s).encode("ascii") + b']'))
+
+    def test_string_values_cached(self):
+        for s in self.strings:
+            text = json.dumps([s, s], ensure_ascii=False)
+            self.assertEqual([s, s], rapidjson.loads(text, cache_values=True))
+
+    def test_invalid_utf8(self):
+        if sys.version_info[0] < 3:
+            return
+        for raw in (b'\xff', b'\xc0\x80', b'\xed\xa0\x80', b'\xf4\x90\x80\x80',
+                    b'\xe3\x81', b'x' * 40 + b'\x80'):
+            self.assertRaises(UnicodeDecodeError, rapidjson.loads,
+                              b'["' + raw + b'"]')
+
+
+class TestDecodeBuffer(unittest.TestCase):
+
+    text = u"""{"test": [1, "こんにちは"]}"""
+    expected = {"test": [1, u"こんにちは"]}
+
+    def test_unicode(self):
+        self.assertEqual(rapidjson.loads(self.text), self.expected)
+
+    def test_bytes(self):
+        ret = rapidjson.loads(self.text.encode("utf-8"))
+        self.assertEqual(ret, self.expected)
+
+    def test_bytearray(self):
+        ret = rapidjson.loads(bytearray(self.text.encode("utf-8")))
+        self.assertEqual(ret, self.expected)
+
+    def test_memoryview(self):
+        data = b"xx" + self.text.encode("utf-8") + b"yy"
+        ret = rapidjson.loads(memoryview(data)[2:-2])
+        self.assertEqual(ret, self.expected)
+
+    def test_mmap(self):
+        import mmap
+        data = self.text.encode("utf-8")
+        m = mmap.mmap(-1, len(data))
+        m.write(data)
+        self.assertEqual(rapidjson.loads(m), self.expected)
+        m.close()
+
+    def test_embedded_nul(self):
+        self.assertRaises(ValueError, rapidjson.loads, b"1\x00 2")
+
+    def test_invalid_type(self):
+        self.assertRaises(TypeError, rapidjson.loads, 1)
+        self.assertRaises(TypeError, rapidjson.loads, None)
+
+
+class TestDecodeReleaseGIL(unittest.TestCase):
+
+    def test_release_gil(self):
+        text = """{"test": [1, "hello", {"a": null}], "b": 1.5}"""
+        ret = rapidjson.loads(text, release_gil=True)
+        self.assertEqual(ret, {"test": [1, "hello", {"a": None}], "b": 1.5})
+
+    def test_release_gil_invalid(self):
+        text = """{"test": [1, "hello"}"""
+        self.assertRaises(ValueError, rapidjson.loads, text, release_gil=True)
+
+    def test_large_document(self):
+        jsonobj = [{"id": i, "name": "item%d" % i} for i in range(30000)]
+        text = json.dumps(jsonobj)
+        self.assertEqual(rapidjson.loads(text), jsonobj)
+        self.assertEqual(rapidjson.loads(text, release_gil=False), jsonobj)
+
+    def test_threads(self):
+        import threading
+        jsonobj = [{"id": i, "tags": ["a", "b"]} for i in range(20000)]
+        text = json.dumps(jsonobj)
+        results = []
+
+        def worker():
+            results.append(rapidjson.loads(text, release_gil=True) == jsonobj)
+
+        threads = [threading.Thread(target=worker) for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(results, [True] * 4)
+
 
 class TestDecodeFail(unittest.TestCase):
 
@@ -115,6 +236,14 @@ class TestDecodeFail(unittest.TestCase):
         text = "'foo'"
         self.assertRaises(ValueError, rapidjson.loads, text)
 
+    def test_unclosed_nested_container(self):
+        text = """[{"a": [1, 2}]"""
+        self.assertRaises(ValueError, rapidjson.loads, text)
+
+    def test_trailing_garbage(self):
+        text = """{"a": 1} x"""
+        self.assertRaises(ValueError, rapidjson.loads, text)
+
 
 class TestEncodeSimple(unittest.TestCase):
 
@@ -199,6 +328,21 @@ class TestEncodeSimple(unittest.TestCase):
         ret = rapidjson.dumps(invalid_jsonobj)
         self.assertEqual(ret, """{"-1.99":1}""")
 
+    def test_large_integer(self):
+        jsonobj = [9223372036854775807, 18446744073709551615,
+                   -9223372036854775808, 123456789012345678901234567890]
+        ret = rapidjson.dumps(jsonobj)
+        self.assertEqual(ret, "[9223372036854775807,18446744073709551615,"
+                              "-9223372036854775808,"
+                              "123456789012345678901234567890]")
+
+    def test_nan(self):
+        self.assertRaises(ValueError, rapidjson.dumps, float("nan"))
+        self.assertRaises(ValueError, rapidjson.dumps, [float("inf")])
+
+    def test_invalid_object(self):
+        self.assertRaises(RuntimeError, rapidjson.dumps, [1, object()])
+
 
 class TestEncodeComplex(unittest.TestCase):
 
@@ -227,6 +371,200 @@ class TestEncodeComplex(unittest.TestCase):
         ret = rapidjson.dumps(jsonobj)
         self.assertEqual(ret, """{"test":[1,"hello"]}""")
 
+    def test_list_of_dicts(self):
+        jsonobj = [{"id": 1, "v": [True, None]}, {"id": 2, "v": {}}]
+        ret = rapidjson.dumps(jsonobj)
+        self.assertEqual(ret, """[{"id":1,"v":[true,null]},{"id":2,"v":{}}]""")
+
+    def test_recursive_list(self):
+        jsonobj = []
+        jsonobj.append(jsonobj)
+        self.assertRaises(RuntimeError, rapidjson.dumps, jsonobj)
+
+    def test_ensure_ascii(self):
+        jsonobj = {u"キー": [u"こんにちは", u"caf\xe9", u"\U0001f600", "ascii"]}
+        ret = rapidjson.dumps(jsonobj)
+        self.assertEqual(ret, '{"\\u30AD\\u30FC":["\\u3053\\u3093\\u306B\\u3061\\u306F",'
+                              '"caf\\u00E9","\\uD83D\\uDE00","ascii"]}')
+        ret = rapidjson.dumps(jsonobj, ensure_ascii=False)
+        if sys.version_info[0] < 3:
+            ret = ret.decode("utf-8")
+        self.assertEqual(ret, u'{"キー":["こんにちは","caf\xe9","\U0001f600","ascii"]}')
+        self.assertEqual(jsonobj, rapidjson.loads(ret))
+
+    def test_ensure_ascii_escapes(self):
+        ret = rapidjson.dumps([u"\u3042\"\n"], ensure_ascii=False)
+        if sys.version_info[0] < 3:
+            ret = ret.decode("utf-8")
+        self.assertEqual(ret, u'["\u3042\\"\\n"]')
+
+    def test_ensure_ascii_dump(self):
+        jsonobj = [u"こんにちは" * 20]
+        fp = io.StringIO()
+        rapidjson.dump(jsonobj, fp, chunk_size=7, ensure_ascii=False)
+        self.assertEqual(fp.getvalue(), u'["%s"]' % (u"こんにちは" * 20))
+        fp = io.BytesIO()
+        rapidjson.dump(jsonobj, fp, chunk_size=7, ensure_ascii=False)
+        self.assertEqual(fp.getvalue(), (u'["%s"]' % (u"こんにちは" * 20)).encode("utf-8"))
+
+    def test_ensure_ascii_encoder(self):
+        encoder = rapidjson.Encoder(ensure_ascii=False)
+        ret = encoder.encode({u"é": u"こんにちは"})
+        if sys.version_info[0] < 3:
+            ret = ret.decode("utf-8")
+        self.assertEqual(ret, u'{"é":"こんにちは"}')
+
+    def test_surrogate_string(self):
+        if sys.version_info[0] < 3:
+            return
+        self.assertRaises(UnicodeEncodeError, rapidjson.dumps, u"\ud800")
+        self.assertRaises(UnicodeEncodeError, rapidjson.dumps, [u"a", u"\ud800"])
+        self.assertRaises(UnicodeEncodeError, rapidjson.dumps, {u"\ud800": 1})
+
+    def test_invalid_utf8_bytes(self):
+        for jsonobj in [b"\xff", [b"a\xe3\x81"], {"k": b"\xc0\xaf"}]:
+            self.assertRaises(ValueError, rapidjson.dumps, jsonobj)
+            self.assertRaises(ValueError, rapidjson.Encoder().encode, jsonobj)
+            self.assertRaises(ValueError, rapidjson.dump, jsonobj, io.StringIO())
+
+    def test_same_keyed_rows(self):
+        rows = [{"id": i, "name": "n%d" % i, "ts": i * 0.5} for i in range(20)]
+        self.assertEqual(json.dumps(rows, separators=(",", ":")), rapidjson.dumps(rows))
+        fp = io.StringIO()
+        rapidjson.dump(rows, fp, chunk_size=16)
+        self.assertEqual(rows, json.loads(fp.getvalue()))
+
+    def test_mixed_rows(self):
+        rows = [{"a": 1, "b": 2}, {"b": 3, "a": 4}, {"a": 5}, {"a": 6, "b": 7},
+                {1: "int key"}, {"a": 8, "b": 9}, {}, [], {u"\u00e9\"\n": {"a": [{"a": 1}]}}]
+        expected = json.dumps(rows, separators=(",", ":"))
+        self.assertEqual(expected.lower(), rapidjson.dumps(rows).lower())
+        self.assertEqual(expected.lower(), rapidjson.dumps(tuple(rows)).lower())
+        ret = rapidjson.dumps(rows, ensure_ascii=False)
+        if sys.version_info[0] < 3:
+            ret = ret.decode("utf-8")
+        self.assertEqual(json.dumps(rows, separators=(",", ":"), ensure_ascii=False), ret)
+
+    def test_sort_keys(self):
+        jsonobj = {"b": 1, "a": {"d": [{"z": 1, "y": 2}, {"z": 3, "y": 4}], "c": 2.5},
+                   u"\u00e9": None, u"\u00e0": "x", "Z": True, u"\U0001f600": 0, u"\uffff": 0}
+        ret = rapidjson.dumps(jsonobj, sort_keys=True, ensure_ascii=False)
+        if sys.version_info[0] < 3:
+            ret = ret.decode("utf-8")
+        self.assertEqual(json.dumps(jsonobj, sort_keys=True, separators=(",", ":"),
+                                    ensure_ascii=False), ret)
+        self.assertEqual(rapidjson.dumps(jsonobj), rapidjson.dumps(jsonobj, sort_keys=False))
+        fp = io.StringIO()
+        rapidjson.dump(jsonobj, fp, chunk_size=8, sort_keys=True)
+        self.assertEqual(rapidjson.dumps(jsonobj, sort_keys=True), fp.getvalue())
+
+    def test_sort_keys_converted(self):
+        self.assertEqual('{"0":"b","1":"a","2":"c"}',
+                         rapidjson.dumps({1: "a", "0": "b", 2: "c"}, sort_keys=True))
+        jsonobj = {}
+        jsonobj["x"] = jsonobj
+        self.assertRaises(RuntimeError, rapidjson.dumps, jsonobj, sort_keys=True)
+
+
+class TestEncodeTypes(unittest.TestCase):
+
+    def test_datetime(self):
+        import datetime
+        utc = datetime.timedelta(0)
+        offsets = [None, utc, datetime.timedelta(hours=-5, minutes=-30),
+                   datetime.timedelta(seconds=3661, microseconds=5)]
+        for offset in offsets:
+            tz = None
+            if offset is not None:
+                if not hasattr(datetime, "timezone"):
+                    continue
+                tz = datetime.timezone(offset)
+            for value in [datetime.datetime(2024, 2, 29, 3, 4, 5, tzinfo=tz),
+                          datetime.datetime(1, 1, 1, 0, 0, 0, 123, tzinfo=tz),
+                          datetime.time(23, 59, 59, 999999, tzinfo=tz)]:
+                self.assertEqual('"%s"' % value.isoformat(), rapidjson.dumps(value))
+        self.assertEqual('["2024-02-29"]', rapidjson.dumps([datetime.date(2024, 2, 29)]))
+
+    def test_uuid(self):
+        import uuid
+        values = [uuid.uuid4(), uuid.UUID(int=0), uuid.UUID(int=(1 << 128) - 1)]
+        self.assertEqual(json.dumps([str(v) for v in values], separators=(",", ":")),
+                         rapidjson.dumps(values))
+
+    def test_decimal(self):
+        from decimal import Decimal
+        self.assertEqual('[1.10,-1E+5,-0,3.141592653589793238462643383279]',
+                         rapidjson.dumps([Decimal("1.10"), Decimal("-1E+5"), Decimal("-0"),
+                                          Decimal("3.141592653589793238462643383279")]))
+        for text in ["NaN", "sNaN", "Infinity", "-Infinity"]:
+            self.assertRaises(ValueError, rapidjson.dumps, Decimal(text))
+
+    def test_enum(self):
+        try:
+            import enum
+        except ImportError:
+            return
+
+        class Color(enum.Enum):
+            RED = 1
+            BLUE = "blue"
+
+        class Level(enum.IntEnum):
+            HIGH = 3
+
+        self.assertEqual('{"c":[1,"blue"],"l":3}',
+                         rapidjson.dumps({"c": [Color.RED, Color.BLUE], "l": Level.HIGH}))
+
+    def test_namedtuple(self):
+        from collections import namedtuple
+        Point = namedtuple("Point", "x y")
+        jsonobj = [Point(1, (2, 3)), (4, 5)]
+        self.assertEqual('[[1,[2,3]],[4,5]]', rapidjson.dumps(jsonobj))
+        self.assertEqual('[{"x":1,"y":[2,3]},[4,5]]',
+                         rapidjson.dumps(jsonobj, namedtuple_as_object=True))
+        self.assertEqual('{"x":1,"y":2}',
+                         rapidjson.Encoder(namedtuple_as_object=True).encode(Point(1, 2)))
+        self.assertEqual(b'[{"x":1,"y":2}]',
+                         b"".join(rapidjson.dump_iter([Point(1, 2)], namedtuple_as_object=True)))
+
+    def test_tuple_subclass_fields_mismatch(self):
+        class Pair(tuple):
+            _fields = ("a",)
+
+        self.assertEqual('[1,2]', rapidjson.dumps(Pair((1, 2))))
+        self.assertEqual('[1,2]', rapidjson.dumps(Pair((1, 2)), namedtuple_as_object=True))
+
+    def test_dataclass(self):
+        try:
+            import dataclasses
+        except ImportError:
+            return
+        namespace = {}
+        exec("import dataclasses, typing\n"
+             "@dataclasses.dataclass\n"
+             "class Item:\n"
+             "    name: str\n"
+             "    children: list = dataclasses.field(default_factory=list)\n"
+             "    count: typing.ClassVar[int] = 0\n", namespace)
+        Item = namespace["Item"]
+        jsonobj = Item("a", [Item("b")])
+        self.assertEqual('{"name":"a","children":[{"name":"b","children":[]}]}',
+                         rapidjson.dumps(jsonobj))
+        self.assertEqual('{"children":[],"name":"b"}', rapidjson.dumps(Item("b"), sort_keys=True))
+
+    def test_default(self):
+        self.assertEqual('{"s":[1,2]}', rapidjson.dumps({"s": set([2, 1])}, default=sorted))
+        self.assertEqual('[[1]]', rapidjson.Encoder(default=list).encode([set([1])]))
+        chunks = rapidjson.dump_iter([set([1])], default=list)
+        self.assertEqual(b'[[1]]', b"".join(chunks))
+        fp = io.StringIO()
+        rapidjson.dump(set([1]), fp, default=list)
+        self.assertEqual('[1]', fp.getvalue())
+        self.assertRaises(RuntimeError, rapidjson.dumps, set([1]))
+        self.assertRaises(RuntimeError, rapidjson.dumps, set([1]), default=None)
+        self.assertRaises(RuntimeError, rapidjson.dumps, set([1]), default=lambda o: o)
+        self.assertRaises(ZeroDivisionError, rapidjson.dumps, set([1]), default=lambda o: 1 / 0)
+
 
 class TestFileStream(unittest.TestCase):
 
@@ -281,6 +619,49 @@ class TestFileStream(unittest.TestCase):
         jsonobj = {"test": [1, "hello"]}
         self.assertRaises(TypeError, rapidjson.dump, jsonobj, "")
 
+    def test_dump_with_chunk_size(self):
+        class ChunkRecorder(object):
+            def __init__(self):
+                self.chunks = []
+
+            def write(self, chunk):
+                self.chunks.append(chunk)
+
+        jsonobj = {"test": [1, "hello"] * 10}
+        recorder = ChunkRecorder()
+        rapidjson.dump(jsonobj, recorder, chunk_size=16)
+        self.assertEqual("".join(recorder.chunks), rapidjson.dumps(jsonobj))
+        self.assertTrue(len(recorder.chunks) > 1)
+        self.assertTrue(all(len(c) <= 16 for c in recorder.chunks))
+        self.assertRaises(ValueError, rapidjson.dump, jsonobj, recorder,
+                          chunk_size=0)
+
+    def test_dump_with_raw_file(self):
+        jsonobj = {"test": [1, "hello"] * 1000}
+        fp = NamedTemporaryFile(delete=False)
+        fp.close()
+        raw = io.FileIO(fp.name, "w")
+        rapidjson.dump(jsonobj, raw, chunk_size=100)
+        raw.close()
+        check_fp = open(fp.name)
+        self.assertEqual(json.load(check_fp), jsonobj)
+        check_fp.close()
+        os.remove(fp.name)
+
+    def test_dump_with_readonly_raw_file(self):
+        fp = NamedTemporaryFile(delete=False)
+        fp.close()
+        raw = io.FileIO(fp.name, "r")
+        self.assertRaises(io.UnsupportedOperation, rapidjson.dump, [1], raw)
+        raw.close()
+        os.remove(fp.name)
+
+    def test_dump_with_io_bytesio(self):
+        jsonobj = {"test": [1, "hello"]}
+        stream = io.BytesIO()
+        rapidjson.dump(jsonobj, stream)
+        self.assertEqual(b"{\"test\":[1,\"hello\"]}", stream.getvalue())
+
     def test_load(self):
         jsonstr = b"""{"test": [1, "hello"]}"""
         fp = NamedTemporaryFile(delete=False)
@@ -340,3 +721,860 @@ class TestFileStream(unittest.TestCase):
 
     def test_load_with_invalid_arg(self):
         self.assertRaises(TypeError, rapidjson.load, "")
+
+    def test_load_with_chunk_size(self):
+        jsonobj = {"test": [1, u"こんにちは", {"a": "hello"}] * 10}
+        stream = StringIO()
+        stream.write(json.dumps(jsonobj))
+        stream.seek(0)
+        retobj = rapidjson.load(stream, chunk_size=3)
+        self.assertEqual(retobj, jsonobj)
+        self.assertRaises(ValueError, rapidjson.load, stream, chunk_size=0)
+
+    def test_load_with_binary_file(self):
+        jsonstr = u"""{"test": [1, "こんにちは"]}""".encode("utf-8")
+        retobj = rapidjson.load(io.BytesIO(jsonstr), chunk_size=5)
+        self.assertEqual(retobj, {"test": [1, u"こんにちは"]})
+
+    def test_load_with_read_error(self):
+        class BrokenFile(object):
+            def read(self, size=-1):
+                raise IOError("broken")
+
+        self.assertRaises(IOError, rapidjson.load, BrokenFile())
+
+    def test_load_with_invalid_json(self):
+        stream = io.BytesIO(b"""{"test": [1, "hello"]""")
+        self.assertRaises(ValueError, rapidjson.load, stream, chunk_size=4)
+
+
+class TestIterLoad(unittest.TestCase):
+
+    def test_reference_cycle(self):
+        class Reader(object):
+            def read(self, size):
+                return ""
+
+        reader = Reader()
+        reader.values = rapidjson.iterload(reader)
+        ref = weakref.ref(reader)
+        del reader
+        gc.collect()
+        self.assertTrue(ref() is None)
+
+    def test_ndjson(self):
+        jsonstr = b"""{"id": 1}\n{"id": 2}\n\n[3]\n"""
+        ret = list(rapidjson.iterload(io.BytesIO(jsonstr), chunk_size=4))
+        self.assertEqual(ret, [{"id": 1}, {"id": 2}, [3]])
+
+    def test_concatenated(self):
+        jsonstr = b"""{"id": 1}{"id": 2} "three" 4 true null"""
+        ret = list(rapidjson.iterload(io.BytesIO(jsonstr)))
+        self.assertEqual(ret, [{"id": 1}, {"id": 2}, "three", 4, True, None])
+
+    def test_empty(self):
+        ret = list(rapidjson.iterload(io.BytesIO(b"  \n")))
+        self.assertEqual(ret, [])
+
+    def test_invalid_record(self):
+        it = rapidjson.iterload(io.BytesIO(b"""{"id": 1}\n{"id": }\n"""))
+        self.assertEqual(next(it), {"id": 1})
+        self.assertRaises(ValueError, next, it)
+        self.assertRaises(StopIteration, next, it)
+
+    def test_value_per_read(self):
+        # like a socket: each read() returns what has arrived, and would
+        # block (here: raise) when asked again before the next message
+        class Pipe(object):
+            def __init__(self, messages):
+                self.messages = list(messages)
+
+            def read(self, size):
+                if not self.messages:
+                    raise IOError("would block")
+                return self.messages.pop(0)
+
+        it = rapidjson.iterload(Pipe([b'{"id": 1}', b'["two"]']))
+        self.assertEqual(next(it), {"id": 1})
+        self.assertEqual(next(it), ["two"])
+        self.assertRaises(IOError, next, it)
+
+    def test_invalid_arg(self):
+        self.assertRaises(TypeError, rapidjson.iterload, "")
+
+
+class TestKeyCache(unittest.TestCase):
+
+    def setUp(self):
+        rapidjson.cache_clear()
+
+    def test_shared_keys(self):
+        text = """[{"id": 1, "name": "a"}, {"id": 2, "name": "b"}]"""
+        ret = rapidjson.loads(text)
+        self.assertEqual(ret, [{"id": 1, "name": "a"}, {"id": 2, "name": "b"}])
+        keys0 = sorted(ret[0].keys())
+        keys1 = sorted(ret[1].keys())
+        self.assertTrue(keys0[0] is keys1[0])
+        self.assertTrue(keys0[1] is keys1[1])
+
+    def test_shared_keys_across_calls(self):
+        ret1 = rapidjson.loads("""{"level": 1}""")
+        ret2 = rapidjson.loads("""{"level": 2}""")
+        self.assertTrue(list(ret1.keys())[0] is list(ret2.keys())[0])
+
+    def test_cache_values(self):
+        text = """[{"level": "debug"}, {"level": "debug"}]"""
+        ret = rapidjson.loads(text, cache_values=True)
+        self.assertEqual(ret, [{"level": "debug"}, {"level": "debug"}])
+        self.assertTrue(ret[0]["level"] is ret[1]["level"])
+
+    def test_cache_info_and_clear(self):
+        rapidjson.loads("""[{"a": 1, "b": 2}, {"a": 3, "b": 4}]""")
+        info = rapidjson.cache_info()
+        self.assertEqual(info["misses"], 2)
+        self.assertEqual(info["hits"], 2)
+        self.assertEqual(info["size"], 2)
+        self.assertTrue(info["maxsize"] > 0)
+        rapidjson.cache_clear()
+        info = rapidjson.cache_info()
+        self.assertEqual(info["size"], 0)
+        self.assertEqual(info["hits"], 0)
+
+    def test_long_key_not_cached(self):
+        key = "k" * 1000
+        ret = rapidjson.loads("""{"%s": 1}""" % key)
+        self.assertEqual(ret, {key: 1})
+        self.assertEqual(rapidjson.cache_info()["size"], 0)
+
+
+class TestLoadPath(unittest.TestCase):
+
+    def setUp(self):
+        fp = NamedTemporaryFile(delete=False)
+        fp.write(u"""{"test": [1, "こんにちは"]}""".encode("utf-8"))
+        fp.close()
+        self.path = fp.name
+
+    def tearDown(self):
+        os.remove(self.path)
+
+    def test_load_path(self):
+        ret = rapidjson.load_path(self.path)
+        self.assertEqual(ret, {"test": [1, u"こんにちは"]})
+
+    def test_load_path_options(self):
+        ret = rapidjson.load_path(self.path, release_gil=True,
+                                  sequential=False, cache_values=True)
+        self.assertEqual(ret, {"test": [1, u"こんにちは"]})
+
+    def test_load_path_bytes(self):
+        ret = rapidjson.load_path(self.path.encode(sys.getfilesystemencoding()))
+        self.assertEqual(ret, {"test": [1, u"こんにちは"]})
+
+    def test_load_path_empty(self):
+        open(self.path, "w").close()
+        self.assertRaises(ValueError, rapidjson.load_path, self.path)
+
+    def test_load_path_not_found(self):
+        self.assertRaises(IOError, rapidjson.load_path, self.path + ".none")
+
+
+class TestDocument(unittest.TestCase):
+
+    text = '{"a": [{"b": 1}, 2, "x"], "c": null, "d": {"e~f": true, "g/h": 1.5}}'
+
+    def test_document_getitem(self):
+        doc = rapidjson.Document(self.text)
+        self.assertEqual(None, doc["c"])
+        self.assertEqual(1, doc["a"][0]["b"])
+        self.assertEqual("x", doc["a"][-1])
+        self.assertTrue(isinstance(doc["a"], rapidjson.Document))
+
+    def test_document_missing(self):
+        doc = rapidjson.Document(self.text)
+        self.assertRaises(KeyError, lambda: doc["z"])
+        self.assertRaises(KeyError, lambda: doc[0])
+        self.assertRaises(IndexError, lambda: doc["a"][3])
+        self.assertRaises(TypeError, lambda: doc["a"]["b"])
+
+    def test_document_len_contains_iter(self):
+        doc = rapidjson.Document(self.text)
+        self.assertEqual(3, len(doc))
+        self.assertEqual(3, len(doc["a"]))
+        self.assertTrue("d" in doc)
+        self.assertFalse("z" in doc)
+        self.assertTrue("x" in doc["a"])
+        self.assertTrue({"b": 1} in doc["a"])
+        self.assertEqual(["a", "c", "d"], list(doc))
+        self.assertEqual([2, "x"], list(doc["a"])[1:])
+
+    def test_document_get(self):
+        doc = rapidjson.Document(self.text)
+        self.assertEqual(1, doc.get("/a/0/b"))
+        self.assertEqual(True, doc.get("/d/e~0f"))
+        self.assertEqual(1.5, doc.get("/d/g~1h"))
+        self.assertEqual(None, doc.get("/a/5"))
+        self.assertEqual("none", doc.get("/z/y", "none"))
+        self.assertEqual("none", doc.get("/c/y", "none"))
+        self.assertTrue(doc.get("") is doc)
+        self.assertRaises(ValueError, doc.get, "a")
+
+    def test_document_cached(self):
+        doc = rapidjson.Document(self.text)
+        self.assertTrue(doc["a"] is doc["a"])
+        self.assertTrue(doc["a"][2] is doc.get("/a/2"))
+
+    def test_document_to_python(self):
+        doc = rapidjson.Document(self.text)
+        self.assertEqual(rapidjson.loads(self.text), doc.to_python())
+        self.assertEqual({"b": 1}, doc["a"][0].to_python())
+        self.assertFalse(doc.to_python() is doc.to_python())
+
+    def test_document_outlives_root(self):
+        sub = rapidjson.Document(self.text)["d"]
+        self.assertEqual({"e~f": True, "g/h": 1.5}, sub.to_python())
+
+    def test_document_scalar(self):
+        doc = rapidjson.Document('"abc"')
+        self.assertEqual("abc", doc.to_python())
+        self.assertRaises(TypeError, len, doc)
+
+    def test_document_invalid(self):
+        self.assertRaises(ValueError, rapidjson.Document, '{"a": ')
+        self.assertRaises(ValueError, rapidjson.Document, '[1] [2]')
+
+
+class TestDecodeFields(unittest.TestCase):
+
+    text = ('{"id": 1, "meta": {"host": "a", "tags": ["x", {"y": 1}]}, '
+            '"items": [{"id": 2, "blob": [1, 2, {"z": 3}]}, {"id": 3}], '
+            '"payload": {"big": [[1], {"a": {"b": null}}]}}')
+
+    def test_fields_pointers(self):
+        ret = rapidjson.loads(self.text, fields=["/id", "/meta/host"])
+        self.assertEqual({"id": 1, "meta": {"host": "a"}}, ret)
+
+    def test_fields_pointer_string(self):
+        ret = rapidjson.loads(self.text, fields="/meta")
+        self.assertEqual({"meta": {"host": "a", "tags": ["x", {"y": 1}]}}, ret)
+
+    def test_fields_array_passthrough(self):
+        ret = rapidjson.loads(self.text, fields={"/items/id"})
+        self.assertEqual({"items": [{"id": 2}, {"id": 3}]}, ret)
+
+    def test_fields_nested_dict(self):
+        ret = rapidjson.loads(self.text,
+                              fields={"id": True, "meta": {"tags": True},
+                                      "payload": False})
+        self.assertEqual({"id": 1, "meta": {"tags": ["x", {"y": 1}]}}, ret)
+
+    def test_fields_overlapping(self):
+        ret = rapidjson.loads(self.text, fields=["/meta/host", "/meta"])
+        self.assertEqual(rapidjson.loads(self.text, fields=["/meta"]), ret)
+        ret = rapidjson.loads(self.text, fields=[""])
+        self.assertEqual(rapidjson.loads(self.text), ret)
+
+    def test_fields_escaped_pointer(self):
+        ret = rapidjson.loads('{"a/b": 1, "c~d": 2, "e": 3}',
+                              fields=["/a~1b", "/c~0d"])
+        self.assertEqual({"a/b": 1, "c~d": 2}, ret)
+
+    def test_fields_missing(self):
+        self.assertEqual({}, rapidjson.loads(self.text, fields=["/none"]))
+        self.assertEqual([1, "a"], rapidjson.loads('[1, "a"]', fields=["/id"]))
+
+    def test_fields_still_validates(self):
+        self.assertRaises(ValueError, rapidjson.loads,
+                          '{"id": 1, "skip": [1, }', fields=["/id"])
+
+    def test_fields_release_gil(self):
+        ret = rapidjson.loads(self.text, fields=["/items/id"], release_gil=True)
+        self.assertEqual({"items": [{"id": 2}, {"id": 3}]}, ret)
+
+    def test_fields_load(self):
+        ret = rapidjson.load(io.StringIO(self.text), chunk_size=7,
+                             fields=["/meta/host"])
+        self.assertEqual({"meta": {"host": "a"}}, ret)
+
+    def test_fields_invalid(self):
+        self.assertRaises(ValueError, rapidjson.loads, self.text, fields=["id"])
+        self.assertRaises(TypeError, rapidjson.loads, self.text, fields=[1])
+        self.assertRaises(TypeError, rapidjson.loads, self.text, fields={1: True})
+
+
+class TestLoadsMany(unittest.TestCase):
+
+    def test_loads_many(self):
+        docs = [{"id": i, "name": "user%d" % i, "tags": ["a", "b"][:i % 3]}
+                for i in range(1000)]
+        texts = [json.dumps(doc) for doc in docs]
+        self.assertEqual(docs, rapidjson.loads_many(texts))
+        for threads in (1, 2, 7, 5000):
+            self.assertEqual(docs, rapidjson.loads_many(texts, threads=threads))
+
+    def test_inputs(self):
+        texts = ['[1]', b'{"a": 2}', bytearray(b'"x"'), memoryview(b'null')]
+        self.assertEqual([[1], {"a": 2}, "x", None],
+                         rapidjson.loads_many(iter(texts), threads=2))
+        self.assertEqual([], rapidjson.loads_many([]))
+        self.assertEqual([], rapidjson.loads_many([], threads=4))
+
+    def test_errors_in_place(self):
+        texts = ['[1]', '[1,', 3, '{"a": 1} x', '1\x002', '"\\u00e9"']
+        ret = rapidjson.loads_many(texts, threads=3)
+        self.assertEqual([1], ret[0])
+        self.assertTrue(isinstance(ret[1], ValueError))
+        self.assertTrue(isinstance(ret[2], TypeError))
+        self.assertTrue(isinstance(ret[3], ValueError))
+        self.assertTrue(isinstance(ret[4], ValueError))
+        self.assertEqual(u"\u00e9", ret[5])
+
+    def test_bad_arguments(self):
+        self.assertRaises(TypeError, rapidjson.loads_many, 1)
+        self.assertRaises(ValueError, rapidjson.loads_many, ['1'], threads=0)
+        self.assertRaises(TypeError, rapidjson.loads_many, ['1'], threads="2")
+
+    def test_cache_values(self):
+        ret = rapidjson.loads_many(['["abc"]', '["abc"]'], threads=2, cache_values=True)
+        self.assertTrue(ret[0][0] is ret[1][0])
+
+
+class TestDecodeColumns(unittest.TestCase):
+
+    text = ('[{"ts": 1500000000000, "id": "a", "v": 1.5, "extra": {"x": [1]}},'
+            ' {"v": 2, "id": null, "ts": -3},'
+            ' {"ts": 7, "id": "\u3042", "v": -0.25}]')
+
+    def test_columns(self):
+        ret = rapidjson.loads_columns(self.text, {"ts": "int64", "v": "float64", "id": "str"})
+        self.assertEqual(["ts", "v", "id"], sorted(ret, key=["ts", "v", "id"].index))
+        self.assertEqual("q", ret["ts"].format)
+        self.assertEqual([1500000000000, -3, 7], ret["ts"].tolist())
+        self.assertEqual("d", ret["v"].format)
+        self.assertEqual([1.5, 2.0, -0.25], ret["v"].tolist())
+        self.assertEqual(["a", None, u"\u3042"], ret["id"])
+
+    def test_columns_buffer(self):
+        import array
+        ret = rapidjson.loads_columns(self.text, {"v": "float32"}, release_gil=True)
+        self.assertEqual(3, len(ret["v"]))
+        self.assertEqual([1.5, 2.0, -0.25], array.array("f", ret["v"].tobytes()).tolist())
+        ret = rapidjson.loads_columns('[{"n": -2147483648}, {"n": 5}]', {"n": "int32"})
+        self.assertEqual([-2147483648, 5], ret["n"].tolist())
+        self.assertRaises(ValueError, rapidjson.loads_columns,
+                          '[{"ts": 3000000000}]', {"ts": "int32"})
+
+    def test_columns_readonly(self):
+        ret = rapidjson.loads_columns(self.text, {"v": "float64"})
+        self.assertTrue(ret["v"].readonly)
+        self.assertRaises(TypeError, ret["v"].__setitem__, 0, 1.0)
+
+    def test_columns_bool_and_empty(self):
+        ret = rapidjson.loads_columns('[{"ok": true}, {"ok": false}]', {"ok": "bool"})
+        self.assertEqual([True, False], ret["ok"].tolist())
+        ret = rapidjson.loads_columns('[]', {"ok": "bool", "name": "str"})
+        self.assertEqual([], ret["ok"].tolist())
+        self.assertEqual([], ret["name"])
+
+    def test_columns_invalid_records(self):
+        for text in ('{"a": 1}', '[1, 2]', '[[1]]', '[{"a": [1]}]', '[{"a": "x"}]',
+                     '[{"a": null}]', '[{"b": 1}]', '[{"a": 1, "a": 2}]', '[{"a": 1.5}]',
+                     '[{"a": 1}', '[{"a": 1}] x'):
+            self.assertRaises(ValueError, rapidjson.loads_columns, text, {"a": "int64"})
+
+    def test_columns_invalid_spec(self):
+        self.assertRaises(ValueError, rapidjson.loads_columns, '[]', {"a": "int8"})
+        self.assertRaises(TypeError, rapidjson.loads_columns, '[]', ["a"])
+
+
+class TestDecoder(unittest.TestCase):
+
+    def test_decoder_reuse(self):
+        decoder = rapidjson.Decoder()
+        for text in ('{"a": [1, "b", null]}', '[1.5, true]', '"abc"'):
+            self.assertEqual(rapidjson.loads(text), decoder.decode(text))
+
+    def test_decoder_after_error(self):
+        decoder = rapidjson.Decoder()
+        self.assertRaises(ValueError, decoder.decode, '{"a": [1, {"b": ')
+        self.assertEqual({"a": [1]}, decoder.decode('{"a": [1]}'))
+
+    def test_decoder_options(self):
+        text = '{"id": 1, "blob": [1, 2, 3], "name": "x"}'
+        decoder = rapidjson.Decoder(fields=["/id", "/name"], cache_values=True)
+        for _ in range(2):
+            self.assertEqual({"id": 1, "name": "x"}, decoder.decode(text))
+
+    def test_decoder_release_gil(self):
+        decoder = rapidjson.Decoder(release_gil=True, max_retained=4096)
+        small = '{"a": [1, 2, {"b": "c"}]}'
+        large = "[" + ",".join(['{"k": "%d"}' % i for i in range(1000)]) + "]"
+        for text in (small, large, small, large):
+            self.assertEqual(rapidjson.loads(text), decoder.decode(text))
+
+    def test_decoder_max_retained(self):
+        decoder = rapidjson.Decoder(max_retained=0)
+        self.assertEqual(["x" * 1000], decoder.decode('["%s"]' % ("x" * 1000)))
+        self.assertEqual([1], decoder.decode(b'[1]'))
+        self.assertRaises(ValueError, rapidjson.Decoder, max_retained=-1)
+
+    def test_decoder_feed(self):
+        values = [{"a": [1, 2.5, "x\\\"y"], "b": None}, [True, False, -12e3], "s", 0, {}]
+        text = "\n".join(json.dumps(v) for v in values) + "\n"
+        for size in (1, 2, 3, 7, len(text)):
+            decoder = rapidjson.Decoder()
+            out = []
+            for i in range(0, len(text), size):
+                out.extend(decoder.feed(text[i:i + size].encode("utf-8")))
+            out.extend(decoder.close())
+            self.assertEqual(values, out)
+
+    def test_decoder_feed_pending(self):
+        decoder = rapidjson.Decoder()
+        self.assertEqual([], decoder.feed('{"a": "lo'))
+        self.assertEqual([], decoder.feed('ng", "n": 12'))
+        self.assertRaises(RuntimeError, decoder.decode, "[]")
+        self.assertEqual([{"a": "long", "n": 123}], decoder.feed('3} 4'))
+        self.assertEqual([4], decoder.close())
+        self.assertEqual([], decoder.close())
+        self.assertEqual([1], decoder.decode("[1]"))
+
+    def test_decoder_feed_errors(self):
+        decoder = rapidjson.Decoder()
+        self.assertEqual([], decoder.feed('[1, 2'))
+        self.assertRaises(ValueError, decoder.close)
+        self.assertRaises(ValueError, decoder.feed, '[1, }')
+        self.assertEqual([[1]], decoder.feed('[1] '))
+        self.assertRaises(ValueError, decoder.feed, '{"a" 1}')
+        self.assertEqual([], decoder.close())
+
+    def test_decoder_feed_fields(self):
+        decoder = rapidjson.Decoder(fields=["/id"])
+        self.assertEqual([{"id": 1}], decoder.feed('{"id": 1, "x": [1, 2]}{"id"'))
+        self.assertEqual([{"id": 2}], decoder.feed(': 2, "x": {"y": 3}}'))
+        self.assertEqual([{"id": 3}, {"id": 4}],
+                         decoder.feed('{"x": 3, "id": 3}{"id": 4, "z": "w"}'))
+
+    def test_decoder_invalid_input(self):
+        self.assertRaises(TypeError, rapidjson.Decoder().decode, 1)
+
+
+class TestDumpIter(unittest.TestCase):
+
+    def records(self, n):
+        for i in range(n):
+            yield {"id": i, "name": u"r\u00e9cord %d" % i}
+
+    def test_dump_iter_reference_cycle(self):
+        class Rows(object):
+            def default(self, obj):
+                return str(obj)
+
+        rows = Rows()
+        rows.chunks = rapidjson.dump_iter([], default=rows.default)
+        ref = weakref.ref(rows)
+        del rows
+        gc.collect()
+        self.assertTrue(ref() is None)
+
+    def test_dump_iter_array(self):
+        chunks = list(rapidjson.dump_iter(self.records(100), chunk_size=256))
+        self.assertTrue(len(chunks) > 1)
+        self.assertTrue(all(isinstance(chunk, bytes) for chunk in chunks))
+        self.assertTrue(all(len(chunk) >= 256 for chunk in chunks[:-1]))
+        self.assertEqual(list(self.records(100)), json.loads(b"".join(chunks).decode("ascii")))
+
+    def test_dump_iter_ndjson(self):
+        data = b"".join(rapidjson.dump_iter(self.records(10), format="ndjson",
+                                            ensure_ascii=False))
+        lines = data.decode("utf-8").splitlines()
+        self.assertEqual(list(self.records(10)), [json.loads(line) for line in lines])
+        self.assertTrue(data.endswith(b"\n"))
+
+    def test_dump_iter_empty(self):
+        self.assertEqual([b"[]"], list(rapidjson.dump_iter(iter([]))))
+        self.assertEqual([], list(rapidjson.dump_iter([], format="ndjson")))
+
+    def test_dump_iter_lazy(self):
+        pulled = []
+
+        def gen():
+            for i in range(1000):
+                pulled.append(i)
+                yield [i] * 10
+        it = rapidjson.dump_iter(gen(), chunk_size=64)
+        first = next(it)
+        self.assertTrue(first.startswith(b"[[0,0,"))
+        self.assertTrue(len(pulled) < 10)
+
+    def test_dump_iter_errors(self):
+        def gen():
+            yield 1
+            raise KeyError("boom")
+        it = rapidjson.dump_iter(gen(), chunk_size=1)
+        self.assertEqual(b"[1", next(it))
+        self.assertRaises(KeyError, next, it)
+        self.assertRaises(StopIteration, next, it)
+        self.assertRaises(RuntimeError, list, rapidjson.dump_iter([1, object()]))
+        self.assertRaises(TypeError, rapidjson.dump_iter, 1)
+        self.assertRaises(ValueError, rapidjson.dump_iter, [], format="csv")
+        self.assertRaises(ValueError, rapidjson.dump_iter, [], chunk_size=0)
+
+
+class TestEncoder(unittest.TestCase):
+
+    def test_encoder_reuse(self):
+        encoder = rapidjson.Encoder()
+        for obj in ({"a": [1, "b", None]}, [1.5, True], "abc", []):
+            self.assertEqual(rapidjson.dumps(obj), encoder.encode(obj))
+
+    def test_encoder_after_error(self):
+        encoder = rapidjson.Encoder()
+        self.assertRaises(RuntimeError, encoder.encode, [1, {"a": object()}])
+        self.assertEqual('[1,{"a":2}]', encoder.encode([1, {"a": 2}]))
+
+    def test_encoder_max_retained(self):
+        encoder = rapidjson.Encoder(max_retained=16)
+        big = ["x" * 100] * 10
+        self.assertEqual(rapidjson.dumps(big), encoder.encode(big))
+        self.assertEqual('[1]', encoder.encode([1]))
+
+    def test_encoder_reentrant(self):
+        encoder = rapidjson.Encoder()
+
+        class Key(object):
+            def __str__(self):
+                return encoder.encode([1])
+
+        self.assertRaises(TypeError, encoder.encode, {Key(): 1})
+        self.assertEqual('[2]', encoder.encode([2]))
+
+
+class TestFingerprint(unittest.TestCase):
+
+    def canonical(self, obj):
+        return json.dumps(obj, sort_keys=True, separators=(",", ":"),
+                          ensure_ascii=False).encode("utf-8")
+
+    def test_sha256(self):
+        jsonobj = {"b": [1, "two", None, True], "a": {u"\u00e9": -3, "c": 2.5}}
+        self.assertEqual(hashlib.sha256(self.canonical(jsonobj)).hexdigest(),
+                         rapidjson.fingerprint(jsonobj))
+        self.assertEqual(hashlib.md5(self.canonical(jsonobj)).hexdigest(),
+                         rapidjson.fingerprint(jsonobj, algo="md5"))
+
+    def test_large(self):
+        jsonobj = [{"k%d" % i: u"\u3042" * 50} for i in range(5000)]
+        self.assertEqual(hashlib.sha256(self.canonical(jsonobj)).hexdigest(),
+                         rapidjson.fingerprint(jsonobj))
+
+    def test_canonical(self):
+        self.assertEqual(rapidjson.fingerprint({"a": 1, "b": [0, 2]}),
+                         rapidjson.fingerprint({"b": [-0.0, 2.0], "a": 1.0}))
+        self.assertNotEqual(rapidjson.fingerprint([1.5]), rapidjson.fingerprint([1]))
+        self.assertNotEqual(rapidjson.fingerprint(["1"]), rapidjson.fingerprint([1]))
+
+    def test_xxh3(self):
+        try:
+            import xxhash
+        except ImportError:
+            return
+        jsonobj = {"b": 1, "a": [u"\u00e9", 2.5]}
+        self.assertEqual(xxhash.xxh3_64(self.canonical(jsonobj)).hexdigest(),
+                         rapidjson.fingerprint(jsonobj, algo="xxh3"))
+
+    def test_fail(self):
+        self.assertRaises(ValueError, rapidjson.fingerprint, [float("nan")])
+        self.assertRaises(RuntimeError, rapidjson.fingerprint, {"a": object()})
+        self.assertRaises(ValueError, rapidjson.fingerprint, [1], algo="no-such-hash")
+
+
+class TestSchema(unittest.TestCase):
+
+    schema = {
+        "type": "object",
+        "properties": {
+            "id": {"type": "integer", "minimum": 1},
+            "name": {"type": "string", "maxLength": 8},
+            "tags": {"type": "array", "items": {"enum": ["a", "b"]}},
+        },
+        "required": ["id"],
+    }
+
+    def test_schema_loads(self):
+        schema = rapidjson.Schema(self.schema)
+        text = '{"id": 3, "name": "abc", "tags": ["a", "b"]}'
+        self.assertEqual(rapidjson.loads(text), rapidjson.loads(text, schema=schema))
+        self.assertEqual(rapidjson.loads(text),
+                         rapidjson.loads(text, schema=schema, release_gil=True))
+
+    def test_schema_from_text(self):
+        schema = rapidjson.Schema(rapidjson.dumps(self.schema))
+        self.assertEqual({"id": 1}, rapidjson.loads('{"id": 1}', schema=schema))
+        schema = rapidjson.Schema(b'{"type": "array"}')
+        self.assertEqual([1], rapidjson.loads('[1]', schema=schema))
+
+    def test_schema_invalid_document(self):
+        schema = rapidjson.Schema(self.schema)
+        for release_gil in (False, True):
+            try:
+                rapidjson.loads('{"id": 3, "name": 5}', schema=schema,
+                                release_gil=release_gil)
+            except rapidjson.ValidationError as e:
+                self.assertEqual("type", e.keyword)
+                self.assertEqual("#/properties/name", e.schema_pointer)
+                self.assertEqual("#/name", e.document_pointer)
+            else:
+                self.fail("ValidationError not raised")
+        self.assertRaises(rapidjson.ValidationError, rapidjson.loads,
+                          '{"name": "abc"}', schema=schema)
+        self.assertRaises(rapidjson.ValidationError, rapidjson.loads,
+                          '{"id": 3, "tags": ["a", "c"]}', schema=schema)
+        self.assertTrue(issubclass(rapidjson.ValidationError, ValueError))
+
+    def test_schema_malformed_text(self):
+        schema = rapidjson.Schema(self.schema)
+        self.assertRaises(ValueError, rapidjson.loads, '{"id": 3', schema=schema)
+        self.assertRaises(ValueError, schema.validate, '{"id": 3} x')
+
+    def test_schema_handler_error(self):
+        # the decoder's error, not a ValidationError without a keyword
+        schema = rapidjson.Schema({})
+        self.assertRaises(UnicodeDecodeError, rapidjson.loads, b'["\xff"]', schema=schema)
+        self.assertRaises(UnicodeDecodeError, rapidjson.loads, b'["\xff"]', schema=schema,
+                          release_gil=True)
+
+    def test_schema_validate(self):
+        schema = rapidjson.Schema(self.schema)
+        self.assertEqual(None, schema.validate('{"id": 2, "tags": []}'))
+        self.assertEqual(None, schema.validate(b'{"id": 2}'))
+        self.assertRaises(rapidjson.ValidationError, schema.validate, '{"id": 0}')
+
+    def test_schema_load(self):
+        schema = rapidjson.Schema(self.schema)
+        self.assertEqual({"id": 1}, rapidjson.load(io.StringIO(u'{"id": 1}'), schema=schema))
+        self.assertRaises(rapidjson.ValidationError, rapidjson.load,
+                          io.StringIO(u'{"id": "1"}'), schema=schema)
+
+    def test_schema_invalid_argument(self):
+        self.assertRaises(ValueError, rapidjson.Schema, '[1, 2]')
+        self.assertRaises(ValueError, rapidjson.Schema, '{"type": ')
+        self.assertRaises(TypeError, rapidjson.loads, '{}', schema=self.schema)
+
+
+class TestStats(unittest.TestCase):
+
+    def setUp(self):
+        rapidjson.reset_stats()
+
+    def test_stats(self):
+        stats = rapidjson.stats()
+        if not stats["enabled"]:
+            self.assertEqual({"enabled": False}, stats)
+            return
+        self.assertEqual(0, stats["decode_calls"])
+        text = '[1, {"a": [2, {"b": []}]}]'
+        rapidjson.loads(text)
+        rapidjson.loads(text, release_gil=True)
+        rapidjson.dumps([[1], "x"])
+        rapidjson.dump({"a": [1]}, io.StringIO())
+        stats = rapidjson.stats()
+        self.assertEqual(2, stats["decode_calls"])
+        self.assertEqual(2, stats["encode_calls"])
+        self.assertEqual(2 * len(text), stats["bytes_in"])
+        self.assertEqual(len('[[1],"x"]') + len('{"a":[1]}'), stats["bytes_out"])
+        self.assertEqual(5, stats["max_depth"])
+        self.assertTrue(stats["allocator_bytes"] > 0)
+        for phase in ("decode_ns", "parse_ns", "convert_ns", "encode_ns"):
+            self.assertTrue(stats[phase] > 0, phase)
+
+    def test_reset_stats(self):
+        rapidjson.loads('[1]')
+        rapidjson.reset_stats()
+        stats = rapidjson.stats()
+        if stats["enabled"]:
+            self.assertEqual(0, stats["decode_calls"])
+            self.assertEqual(0, stats["bytes_in"])
+
+
+class TestThreads(unittest.TestCase):
+
+    def run_threads(self, target, count=8):
+        errors = []
+
+        def run():
+            try:
+                target()
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=run) for _ in range(count)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual([], errors)
+
+    def test_loads_dumps(self):
+        docs = [{"id": i, "name": "user%d" % i, "tags": ["a", "b"][:i % 3],
+                 "score": i * 0.5} for i in range(200)]
+        text = json.dumps(docs)
+
+        def work():
+            for _ in range(30):
+                self.assertEqual(docs, rapidjson.loads(text))
+                self.assertEqual(docs, rapidjson.loads(text, release_gil=True))
+                self.assertEqual(docs, json.loads(rapidjson.dumps(docs)))
+
+        self.run_threads(work)
+
+    def test_key_cache(self):
+        # more distinct keys than cache slots, so threads keep replacing
+        # each other's entries while another one clears the cache
+        docs = [dict(("k%d_%d" % (n, i), i) for i in range(50)) for n in range(100)]
+        texts = [json.dumps(doc) for doc in docs]
+        done = []
+
+        def clear():
+            while not done:
+                rapidjson.cache_clear()
+
+        clearer = threading.Thread(target=clear)
+        clearer.start()
+        try:
+            def work():
+                for _ in range(5):
+                    for doc, text in zip(docs, texts):
+                        self.assertEqual(doc, rapidjson.loads(text))
+
+            self.run_threads(work)
+        finally:
+            done.append(True)
+            clearer.join()
+        info = rapidjson.cache_info()
+        self.assertTrue(info["size"] <= info["maxsize"])
+
+    def test_shared_document(self):
+        doc = rapidjson.Document(json.dumps(
+            {"items": [{"id": i, "tags": ["t%d" % i]} for i in range(100)]}))
+        seen = []
+
+        def work():
+            items = doc["items"]
+            seen.append(items)
+            for i in range(100):
+                self.assertEqual(["t%d" % i], items[i]["tags"].to_python())
+                self.assertTrue(items[i] is items[i])
+
+        self.run_threads(work)
+        self.assertTrue(all(items is doc["items"] for items in seen))
+
+    def test_mutated_while_encoding(self):
+        items = [{"a": i, "b": [i] * 10} for i in range(100)]
+        done = []
+
+        def mutate():
+            i = 0
+            while not done:
+                items.append({"a": i, "b": [i]})
+                items[i % 50]["c"] = i
+                items.pop(0)
+                i += 1
+
+        mutator = threading.Thread(target=mutate)
+        mutator.start()
+        try:
+            def work():
+                for _ in range(100):
+                    self.assertTrue(isinstance(json.loads(rapidjson.dumps(items)), list))
+
+            self.run_threads(work)
+        finally:
+            done.append(True)
+            mutator.join()
+
+    def test_shared_decoder(self):
+        decoder = rapidjson.Decoder(release_gil=True)
+        encoder = rapidjson.Encoder()
+        doc = [{"id": i, "name": "x" * (i % 20)} for i in range(2000)]
+        text = json.dumps(doc)
+
+        def work():
+            for _ in range(20):
+                try:
+                    self.assertEqual(doc, decoder.decode(text))
+                    self.assertEqual(doc, json.loads(encoder.encode(doc)))
+                except RuntimeError as e:
+                    # another thread is using it
+                    self.assertTrue("already in use" in str(e))
+
+        self.run_threads(work)
+
+    def test_subinterpreter(self):
+        try:
+            import _xxsubinterpreters as interpreters
+        except ImportError:
+            return
+        try:
+            interp = interpreters.create(isolated=False)
+        except TypeError:
+            interp = interpreters.create()
+        rapidjson.cache_clear()
+        script = "\n".join([
+            "import sys",
+            "sys.path[:0] = %r" % sys.path,
+            "import rapidjson",
+            "assert rapidjson.loads('{\"sub\": [1]}') == {'sub': [1]}",
+            "assert rapidjson.cache_info()['size'] == 1",
+            "assert issubclass(rapidjson.ValidationError, ValueError)",
+        ])
+        try:
+            interpreters.run_string(interp, script)
+            # the subinterpreter's entries are not shared
+            self.assertEqual(0, rapidjson.cache_info()["size"])
+        finally:
+            interpreters.destroy(interp)
+        # and are gone with it
+        self.assertEqual({"sub": 1}, rapidjson.loads('{"sub": 1}'))
+        self.assertEqual(1, rapidjson.cache_info()["size"])
+
+
+class TestBuildInfo(unittest.TestCase):
+
+    def run_variant(self, variant):
+        env = dict(os.environ, PYRAPIDJSON_VARIANT=variant,
+                   PYTHONPATH=os.pathsep.join(sys.path))
+        code = "import rapidjson; print(rapidjson.build_info()['variant'])"
+        proc = subprocess.Popen([sys.executable, "-c", code], env=env,
+                                stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+        out, err = proc.communicate()
+        return proc.returncode, out.decode("ascii").strip(), err.decode("utf-8")
+
+    def test_build_info(self):
+        info = rapidjson.build_info()
+        self.assertTrue(info["variant"] in ("default", "baseline", "sse42", "avx2"))
+        self.assertTrue(isinstance(info["simd"], tuple))
+        self.assertTrue(isinstance(info["rapidjson"], str))
+
+    def test_dispatch(self):
+        if not hasattr(rapidjson, "VARIANTS"):
+            return
+        info = rapidjson.build_info()
+        forced = os.environ.get("PYRAPIDJSON_VARIANT")
+        self.assertEqual(bool(forced), info["forced"])
+        self.assertTrue(info["variant"] in info["supported"])
+        self.assertEqual("baseline", info["supported"][-1])
+        if forced:
+            self.assertEqual(forced, info["variant"])
+        else:
+            # the best supported variant that is built for this platform
+            self.assertEqual(info["supported"][0], info["variant"])
+
+    def test_forced_variant(self):
+        if not hasattr(rapidjson, "VARIANTS"):
+            return
+        for variant in rapidjson.build_info()["supported"]:
+            self.assertEqual((0, variant), self.run_variant(variant)[:2])
+        returncode, out, err = self.run_variant("nosuchisa")
+        self.assertNotEqual(0, returncode)
+        self.assertTrue("ImportError" in err)